@@ -39,4 +39,40 @@ public:
     static glm::vec3 unitVec3() {
         return glm::normalize(Vec3() - 0.5f);
     }
+};
+
+// PCG32 (pcg-random.org), 8 bytes of state instead of the 2.5KB of mt19937. Seeded from what is being sampled instead of
+// the thread, so the same pixel draws the same numbers whichever thread renders it.
+class PCG {
+    static constexpr uint64_t multiplier = 6364136223846793005ull;
+    static constexpr uint64_t increment = 1442695040888963407ull;
+    uint64_t state;
+
+public:
+    explicit PCG(uint64_t seed) : state(0) {
+        UInt();
+        state += seed;
+        UInt();
+    }
+
+    // neighbouring pixels and frames get unrelated sequences, the seed is hashed (splitmix64) since close pcg seeds are correlated
+    static uint64_t seed(uint32_t pixel, uint32_t frameIndex, uint32_t bounce) {
+        uint64_t z = ((uint64_t)frameIndex << 32 | pixel) + (uint64_t)bounce * 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    uint32_t UInt() {
+        uint64_t oldState = state;
+        state = oldState * multiplier + increment;
+        uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+        uint32_t rot = (uint32_t)(oldState >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+    }
+
+    // return value [0, 1)
+    float Float() {
+        return (float)(UInt() >> 8) * (1.0f / 16777216.0f);
+    }
 };
\ No newline at end of file
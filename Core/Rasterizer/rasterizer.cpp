@@ -1,8 +1,14 @@
 #include "rasterizer.h"
 #include "shader.h"
 #include "utils.hpp"
+#include "timer.h"
+#include "random.h"
 
 #include <iostream>
+#include <atomic>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 void Rasterizer::resize(uint32_t width, uint32_t height) {
     if (!image) {
@@ -22,102 +28,834 @@ void Rasterizer::resize(uint32_t width, uint32_t height) {
     depthBuffer.resize(width * height);
 }
 
-void Rasterizer::rasterize(std::array<V2F, 3> &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights) {
-    const int width = image->getWidth();
-    const int height = image->getHeight();
+void Rasterizer::updateTiles() {
+    uint32_t size = std::max(settings.tileSize, 8u);
+    uint32_t width = image->getWidth(), height = image->getHeight();
+    if (size == tileSize && width == tiledWidth && height == tiledHeight) {
+        return;
+    }
+    tileSize = size;
+    tiledWidth = width;
+    tiledHeight = height;
+
+    tileColumns = (width + size - 1) / size;
+    uint32_t rows = (height + size - 1) / size;
+    tiles.clear();
+    for (uint32_t ty = 0; ty < rows; ++ty) {
+        for (uint32_t tx = 0; tx < tileColumns; ++tx) {
+            tiles.push_back({tx * size, ty * size, std::min(size, width - tx * size), std::min(size, height - ty * size)});
+        }
+    }
+}
 
-    int left = (int)(std::min(std::min(v2fs[0].position.x, v2fs[1].position.x), v2fs[2].position.x));
-    int right = (int)(std::max(std::max(v2fs[0].position.x, v2fs[1].position.x), v2fs[2].position.x));
-    int bottom = (int)(std::min(std::min(v2fs[0].position.y, v2fs[1].position.y), v2fs[2].position.y));
-    int top = (int)(std::max(std::max(v2fs[0].position.y, v2fs[1].position.y), v2fs[2].position.y));
+// the pixels the triangle may cover, empty when it is off screen
+static void screenBounds(const std::array<const V2F *, 3> &v2fs, int width, int height, int &left, int &right, int &bottom, int &top) {
+    left = (int)(std::min(std::min(v2fs[0]->position.x, v2fs[1]->position.x), v2fs[2]->position.x));
+    right = (int)(std::max(std::max(v2fs[0]->position.x, v2fs[1]->position.x), v2fs[2]->position.x));
+    bottom = (int)(std::min(std::min(v2fs[0]->position.y, v2fs[1]->position.y), v2fs[2]->position.y));
+    top = (int)(std::max(std::max(v2fs[0]->position.y, v2fs[1]->position.y), v2fs[2]->position.y));
 
     left = std::max(0, left);
     right = std::min(width - 1, right);
     bottom = std::max(0, bottom);
-    top = std::min(height - 1, top);    
+    top = std::min(height - 1, top);
+}
+
+void Rasterizer::shadePixel(const Primitive &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights,
+    int x, int y, float alpha, float beta, float gamma) {
+    int index = y * image->getWidth() + x;
+    float zCorrection = 1.0f / (alpha + beta + gamma);
+    // early-z
+    if (zCorrection > depthBuffer[index]) {
+        return;
+    }
+
+    V2F v2f;
+    v2f.albedo = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0]->albedo, v2fs[1]->albedo, v2fs[2]->albedo);
+    v2f.normal = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0]->normal, v2fs[1]->normal, v2fs[2]->normal);
+    v2f.position = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0]->position, v2fs[1]->position, v2fs[2]->position);
+    v2f.worldPosition = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0]->worldPosition, v2fs[1]->worldPosition, v2fs[2]->worldPosition);
+    v2f.texcoords = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0]->texcoords, v2fs[1]->texcoords, v2fs[2]->texcoords);
+    v2f.viewDir = activeCamera->getPosition() - v2f.worldPosition;
+    
+    glm::vec4 color = fs.frag(v2f, mat, lights);
+    // todo: alpha/stencil
+    colorBuffer[index] = color;
+    depthBuffer[index] = std::min(depthBuffer[index], zCorrection);
+}
+
+void Rasterizer::rasterizeBoundingBox(const Primitive &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights, const Tile &tile) {
+    const int width = image->getWidth();
+    const int height = image->getHeight();
+
+    int left, right, bottom, top;
+    screenBounds(v2fs, width, height, left, right, bottom, top);
+    left = std::max((int)tile.x, left);
+    right = std::min((int)(tile.x + tile.width) - 1, right);
+    bottom = std::max((int)tile.y, bottom);
+    top = std::min((int)(tile.y + tile.height) - 1, top);
 
     for (int y = bottom; y <= top; ++y) {
         for (int x = left; x <= right; ++x) {
-            float t1 = (v2fs[0].position.x - x) * (v2fs[1].position.y - y) - (v2fs[0].position.y - y) * (v2fs[1].position.x - x);
-            float t2 = (v2fs[1].position.x - x) * (v2fs[2].position.y - y) - (v2fs[1].position.y - y) * (v2fs[2].position.x - x);
-            float t3 = (v2fs[2].position.x - x) * (v2fs[0].position.y - y) - (v2fs[2].position.y - y) * (v2fs[0].position.x - x);
+            float t1 = (v2fs[0]->position.x - x) * (v2fs[1]->position.y - y) - (v2fs[0]->position.y - y) * (v2fs[1]->position.x - x);
+            float t2 = (v2fs[1]->position.x - x) * (v2fs[2]->position.y - y) - (v2fs[1]->position.y - y) * (v2fs[2]->position.x - x);
+            float t3 = (v2fs[2]->position.x - x) * (v2fs[0]->position.y - y) - (v2fs[2]->position.y - y) * (v2fs[0]->position.x - x);
 
             // back culling
             if (t1 >= 0 && t2 >= 0 && t3 >= 0) {
-                int index = y * width + x;
-                float alpha = t2 / (t1 + t2 + t3) / v2fs[0].position[3];
-                float beta = t3 / (t1 + t2 + t3) / v2fs[1].position[3];
-                float gamma = t1 / (t1 + t2 + t3) / v2fs[2].position[3];
-                float zCorrection = 1.0f / (alpha + beta + gamma);
-                // early-z
-                if (zCorrection > depthBuffer[index]) {
-                    continue;
+                float alpha = t2 / (t1 + t2 + t3) / v2fs[0]->position[3];
+                float beta = t3 / (t1 + t2 + t3) / v2fs[1]->position[3];
+                float gamma = t1 / (t1 + t2 + t3) / v2fs[2]->position[3];
+                shadePixel(v2fs, fs, mat, lights, x, y, alpha, beta, gamma);
+            }
+        }
+    }
+}
+
+namespace {
+// The edge function from a to b, a * x + b * y + c, the same value as the cross product of the vertices relative to the pixel.
+// Positive on the inner side of a counterclockwise triangle. x and y are relative to an origin pixel near the triangle, with screen
+// coordinates c would be the difference of two large products and lose most of its bits.
+struct EdgeEquation {
+    float a, b, c;
+
+    EdgeEquation(const glm::vec4 &from, const glm::vec4 &to, const glm::vec2 &origin)
+        : a(from.y - to.y), b(to.x - from.x), c((from.x - origin.x) * (to.y - origin.y) - (from.y - origin.y) * (to.x - origin.x)) {
+    }
+
+    float at(float x, float y) const { return a * x + b * y + c; }
+};
+
+// The edge function on the sub-pixel grid, exact in 64 bits, so both triangles of a shared edge get the same value at every pixel
+// with opposite signs.
+struct FixedEdgeEquation {
+    int64_t a, b, c;
+    // inside when at() >= threshold, by the top-left rule only left edges (inside towards +x) and top edges (horizontal, inside
+    // towards -y) own the pixel centers on them, so a pixel on a shared edge belongs to exactly one of the triangles
+    int64_t threshold;
+
+    FixedEdgeEquation(int64_t fromX, int64_t fromY, int64_t toX, int64_t toY)
+        : a(fromY - toY), b(toX - fromX), c(fromX * toY - fromY * toX), threshold(a > 0 || (a == 0 && b < 0) ? 0 : 1) {
+    }
+
+    int64_t at(int64_t x, int64_t y) const { return a * x + b * y + c; }
+
+    // the center of pixel p on the sub-pixel grid
+    static int64_t pixelCenter(int p) { return (int64_t)p * Rasterizer::subPixelScale + Rasterizer::subPixelScale / 2; }
+};
+}
+
+static uint32_t lowestBit(uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctzll(mask);
+#endif
+}
+
+// bit x + y * blockSize for each pixel of the block at (blockX, blockY) inside all three edges, relative to the origin of the edges.
+// The edge values are evaluated once at the block and then step by a from column to column and by b from row to row
+static uint64_t blockCoverage(const EdgeEquation *edges, int blockX, int blockY, CoverageKernel kernel) {
+    constexpr uint32_t size = Rasterizer::blockSize;
+    uint64_t mask = 0;
+#if SIMD_AVX2
+    if (kernel == CoverageKernel::AVX2) {
+        // a row of the block per register
+        const __m256 columns = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+        const __m256 zero = _mm256_setzero_ps();
+        __m256 e[3], b[3];
+        for (int k = 0; k < 3; ++k) {
+            e[k] = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(edges[k].a), columns), _mm256_set1_ps(edges[k].at((float)blockX, (float)blockY)));
+            b[k] = _mm256_set1_ps(edges[k].b);
+        }
+        for (uint32_t row = 0; row < size; ++row) {
+            int inside = 0xFF;
+            for (int k = 0; k < 3; ++k) {
+                inside &= _mm256_movemask_ps(_mm256_cmp_ps(e[k], zero, _CMP_GE_OQ));
+                e[k] = _mm256_add_ps(e[k], b[k]);
+            }
+            mask |= (uint64_t)inside << (row * size);
+        }
+        return mask;
+    }
+#endif
+#if SIMD_SSE
+    if (kernel == CoverageKernel::SSE) {
+        // two registers per row
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 columns = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+        __m128 e[3][2], b[3];
+        for (int k = 0; k < 3; ++k) {
+            const __m128 a = _mm_set1_ps(edges[k].a);
+            e[k][0] = _mm_add_ps(_mm_mul_ps(a, columns), _mm_set1_ps(edges[k].at((float)blockX, (float)blockY)));
+            e[k][1] = _mm_add_ps(_mm_mul_ps(a, columns), _mm_set1_ps(edges[k].at((float)(blockX + 4), (float)blockY)));
+            b[k] = _mm_set1_ps(edges[k].b);
+        }
+        for (uint32_t row = 0; row < size; ++row) {
+            int inside = 0xFF;
+            for (int k = 0; k < 3; ++k) {
+                int low = _mm_movemask_ps(_mm_cmpge_ps(e[k][0], zero));
+                int high = _mm_movemask_ps(_mm_cmpge_ps(e[k][1], zero));
+                inside &= low | (high << 4);
+                e[k][0] = _mm_add_ps(e[k][0], b[k]);
+                e[k][1] = _mm_add_ps(e[k][1], b[k]);
+            }
+            mask |= (uint64_t)inside << (row * size);
+        }
+        return mask;
+    }
+#endif
+    (void)kernel;
+    float rowStart[3];
+    for (int k = 0; k < 3; ++k) {
+        rowStart[k] = edges[k].at((float)blockX, (float)blockY);
+    }
+    for (uint32_t row = 0; row < size; ++row) {
+        float e[3] = {rowStart[0], rowStart[1], rowStart[2]};
+        for (uint32_t column = 0; column < size; ++column) {
+            if (e[0] >= 0.0f && e[1] >= 0.0f && e[2] >= 0.0f) {
+                mask |= 1ull << (column + row * size);
+            }
+            for (int k = 0; k < 3; ++k) {
+                e[k] += edges[k].a;
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            rowStart[k] += edges[k].b;
+        }
+    }
+    return mask;
+}
+
+// the same for the pixel centers. The simd kernels work in doubles, within fixedPointRange every product and sum is an integer
+// below 2^53 and so exact
+static uint64_t blockCoverage(const FixedEdgeEquation *edges, int blockX, int blockY, CoverageKernel kernel) {
+    constexpr uint32_t size = Rasterizer::blockSize;
+    const double step = (double)Rasterizer::subPixelScale;
+    const int64_t x0 = FixedEdgeEquation::pixelCenter(blockX), y0 = FixedEdgeEquation::pixelCenter(blockY);
+    uint64_t mask = 0;
+#if SIMD_AVX2
+    if (kernel == CoverageKernel::AVX2) {
+        // two registers per row, stepped by b * subPixelScale from row to row
+        const __m256d columns = _mm256_set_pd(3.0 * step, 2.0 * step, step, 0.0);
+        __m256d e[3][2], b[3], threshold[3];
+        for (int k = 0; k < 3; ++k) {
+            const __m256d a = _mm256_set1_pd((double)edges[k].a);
+            e[k][0] = _mm256_add_pd(_mm256_mul_pd(a, columns), _mm256_set1_pd((double)edges[k].at(x0, y0)));
+            e[k][1] = _mm256_add_pd(_mm256_mul_pd(a, columns), _mm256_set1_pd((double)edges[k].at(x0 + 4 * Rasterizer::subPixelScale, y0)));
+            b[k] = _mm256_set1_pd((double)(edges[k].b * Rasterizer::subPixelScale));
+            threshold[k] = _mm256_set1_pd((double)edges[k].threshold);
+        }
+        for (uint32_t row = 0; row < size; ++row) {
+            int inside = 0xFF;
+            for (int k = 0; k < 3; ++k) {
+                int low = _mm256_movemask_pd(_mm256_cmp_pd(e[k][0], threshold[k], _CMP_GE_OQ));
+                int high = _mm256_movemask_pd(_mm256_cmp_pd(e[k][1], threshold[k], _CMP_GE_OQ));
+                inside &= low | (high << 4);
+                e[k][0] = _mm256_add_pd(e[k][0], b[k]);
+                e[k][1] = _mm256_add_pd(e[k][1], b[k]);
+            }
+            mask |= (uint64_t)inside << (row * size);
+        }
+        return mask;
+    }
+#endif
+#if SIMD_SSE
+    if (kernel == CoverageKernel::SSE) {
+        // four registers per row
+        const __m128d columns = _mm_set_pd(step, 0.0);
+        __m128d e[3][4], b[3], threshold[3];
+        for (int k = 0; k < 3; ++k) {
+            const __m128d a = _mm_set1_pd((double)edges[k].a);
+            for (int part = 0; part < 4; ++part) {
+                e[k][part] = _mm_add_pd(_mm_mul_pd(a, columns), _mm_set1_pd((double)edges[k].at(x0 + 2 * part * Rasterizer::subPixelScale, y0)));
+            }
+            b[k] = _mm_set1_pd((double)(edges[k].b * Rasterizer::subPixelScale));
+            threshold[k] = _mm_set1_pd((double)edges[k].threshold);
+        }
+        for (uint32_t row = 0; row < size; ++row) {
+            int inside = 0xFF;
+            for (int k = 0; k < 3; ++k) {
+                int bits = 0;
+                for (int part = 0; part < 4; ++part) {
+                    bits |= _mm_movemask_pd(_mm_cmpge_pd(e[k][part], threshold[k])) << (2 * part);
+                    e[k][part] = _mm_add_pd(e[k][part], b[k]);
                 }
+                inside &= bits;
+            }
+            mask |= (uint64_t)inside << (row * size);
+        }
+        return mask;
+    }
+#endif
+    (void)kernel;
+    // the edge functions step by a * subPixelScale from pixel to pixel and by b * subPixelScale from row to row
+    int64_t rowStart[3];
+    for (int k = 0; k < 3; ++k) {
+        rowStart[k] = edges[k].at(x0, y0);
+    }
+    for (uint32_t row = 0; row < size; ++row) {
+        int64_t e[3] = {rowStart[0], rowStart[1], rowStart[2]};
+        for (uint32_t column = 0; column < size; ++column) {
+            if (e[0] >= edges[0].threshold && e[1] >= edges[1].threshold && e[2] >= edges[2].threshold) {
+                mask |= 1ull << (column + row * size);
+            }
+            for (int k = 0; k < 3; ++k) {
+                e[k] += edges[k].a * Rasterizer::subPixelScale;
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            rowStart[k] += edges[k].b * Rasterizer::subPixelScale;
+        }
+    }
+    return mask;
+}
 
-                V2F v2f;
-                v2f.albedo = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0].albedo, v2fs[1].albedo, v2fs[2].albedo);
-                v2f.normal = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0].normal, v2fs[1].normal, v2fs[2].normal);
-                v2f.position = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0].position, v2fs[1].position, v2fs[2].position);
-                v2f.worldPosition = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0].worldPosition, v2fs[1].worldPosition, v2fs[2].worldPosition);
-                v2f.texcoords = zCorrection * Utils::lerp(alpha, beta, gamma, v2fs[0].texcoords, v2fs[1].texcoords, v2fs[2].texcoords);
-                v2f.viewDir = activeCamera->getPosition() - v2f.worldPosition;
-                
-                glm::vec4 color = fs.frag(v2f, mat, lights);
-                // todo: alpha/stencil
-                colorBuffer[index] = color;
-                depthBuffer[index] = std::min(depthBuffer[index], zCorrection);
+// shade(x, y) for every pixel within the bounds that cover(blockX, blockY) sets in the mask of its block
+template <typename Cover, typename Shade>
+static void forEachCoveredPixel(int left, int right, int bottom, int top, Cover &&cover, Shade &&shade) {
+    constexpr int size = (int)Rasterizer::blockSize;
+    for (int blockY = bottom / size * size; blockY <= top; blockY += size) {
+        // the rows of the block within the bounds
+        const int rowBegin = std::max(bottom - blockY, 0), rowEnd = std::min(top - blockY + 1, size);
+        uint64_t rows = 0;
+        for (int row = rowBegin; row < rowEnd; ++row) {
+            rows |= 0xFFull << (row * size);
+        }
+        for (int blockX = left / size * size; blockX <= right; blockX += size) {
+            const int columnBegin = std::max(left - blockX, 0), columnEnd = std::min(right - blockX + 1, size);
+            const uint64_t columns = ((1ull << columnEnd) - 1) & ~((1ull << columnBegin) - 1);
+            uint64_t mask = rows & (columns * 0x0101010101010101ull);
+            if (mask) {
+                mask &= cover(blockX, blockY);
+            }
+            while (mask) {
+                const uint32_t bit = lowestBit(mask);
+                mask &= mask - 1;
+                shade(blockX + (int)(bit % Rasterizer::blockSize), blockY + (int)(bit / Rasterizer::blockSize));
             }
         }
     }
 }
 
-void Rasterizer::render(const Scene &scene, const Camera &camera) {
-    activeCamera = &camera;
-    activeScene = &scene;
-    // clear buffer
-    std::fill(colorBuffer.begin(), colorBuffer.end(), glm::vec4(0, 0, 0, 1));
-    std::fill(depthBuffer.begin(), depthBuffer.end(), std::numeric_limits<float>::max());
-    BasicVertexShader vs;
-    BasicFragmentShader fs;
-    // set view and projection transformation matrix in vs
-    vs.setView(camera.getView());
-    vs.setProjection(camera.getProjection());
-    for (const auto &model : scene.models) {
+void Rasterizer::rasterize(const Primitive &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights, const Tile &tile) {
+    const int width = image->getWidth();
+    const int height = image->getHeight();
+
+    int left, right, bottom, top;
+    screenBounds(v2fs, width, height, left, right, bottom, top);
+    left = std::max((int)tile.x, left);
+    right = std::min((int)(tile.x + tile.width) - 1, right);
+    bottom = std::max((int)tile.y, bottom);
+    top = std::min((int)(tile.y + tile.height) - 1, top);
+    if (left > right || bottom > top) {
+        return;
+    }
+    if (settings.fixedPoint && rasterizeFixedPoint(v2fs, fs, mat, lights, left, right, bottom, top)) {
+        return;
+    }
+
+    // triangle setup, t1 is the edge from the first to the second vertex, t2 from the second to the third and t3 back to the first.
+    // The origin is the pixel at the corner of the bounds of the whole triangle, so every tile evaluates the same edges
+    const int originX = (int)std::floor(std::min(std::min(v2fs[0]->position.x, v2fs[1]->position.x), v2fs[2]->position.x));
+    const int originY = (int)std::floor(std::min(std::min(v2fs[0]->position.y, v2fs[1]->position.y), v2fs[2]->position.y));
+    const glm::vec2 origin((float)originX, (float)originY);
+    const EdgeEquation edges[3] = {{v2fs[0]->position, v2fs[1]->position, origin}, {v2fs[1]->position, v2fs[2]->position, origin},
+        {v2fs[2]->position, v2fs[0]->position, origin}};
+    // the a and b of the three edges add up to 0, so t1 + t2 + t3 is the same for every pixel
+    const float area = edges[0].c + edges[1].c + edges[2].c;
+    // back culling, no pixel has all three edge functions >= 0
+    if (!(area > 0.0f)) {
+        return;
+    }
+    const float inverseArea = 1.0f / area;
+    const float weights[3] = {inverseArea / v2fs[0]->position[3], inverseArea / v2fs[1]->position[3], inverseArea / v2fs[2]->position[3]};
+    const CoverageKernel kernel = settings.coverageKernel;
+
+    forEachCoveredPixel(left, right, bottom, top, [&](int blockX, int blockY) {
+        // the edge functions are linear, so over the block they are smallest and largest at its corners
+        bool covered = true, outside = false;
+        const int localX = blockX - originX, localY = blockY - originY;
+        for (const auto &edge : edges) {
+            const float corner = edge.at((float)localX, (float)localY);
+            const float extent = (float)(blockSize - 1);
+            const float largest = corner + std::max(edge.a, 0.0f) * extent + std::max(edge.b, 0.0f) * extent;
+            const float smallest = corner + std::min(edge.a, 0.0f) * extent + std::min(edge.b, 0.0f) * extent;
+            outside |= largest < 0.0f;
+            covered &= smallest >= 0.0f;
+        }
+        if (outside) {
+            return 0ull;
+        }
+        return covered ? ~0ull : blockCoverage(edges, localX, localY, kernel);
+    }, [&](int x, int y) {
+        const float fx = (float)(x - originX), fy = (float)(y - originY);
+        shadePixel(v2fs, fs, mat, lights, x, y, edges[1].at(fx, fy) * weights[0], edges[2].at(fx, fy) * weights[1], edges[0].at(fx, fy) * weights[2]);
+    });
+}
+
+bool Rasterizer::rasterizeFixedPoint(const Primitive &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights,
+    int left, int right, int bottom, int top) {
+    // snap the vertices to the sub-pixel grid
+    int64_t xs[3], ys[3];
+    for (int k = 0; k < 3; ++k) {
+        const float x = v2fs[k]->position.x * (float)subPixelScale, y = v2fs[k]->position.y * (float)subPixelScale;
+        if (!(std::abs(x) < (float)fixedPointRange && std::abs(y) < (float)fixedPointRange)) {
+            return false;
+        }
+        xs[k] = (int64_t)std::floor(x + 0.5f);
+        ys[k] = (int64_t)std::floor(y + 0.5f);
+    }
+
+    const FixedEdgeEquation edges[3] = {{xs[0], ys[0], xs[1], ys[1]}, {xs[1], ys[1], xs[2], ys[2]}, {xs[2], ys[2], xs[0], ys[0]}};
+    const int64_t area = edges[0].c + edges[1].c + edges[2].c;
+    // back culling, and triangles which collapsed to a line on the grid cover nothing
+    if (area <= 0) {
+        return true;
+    }
+    const float inverseArea = 1.0f / (float)area;
+    const float weights[3] = {inverseArea / v2fs[0]->position[3], inverseArea / v2fs[1]->position[3], inverseArea / v2fs[2]->position[3]};
+    const CoverageKernel kernel = settings.coverageKernel;
+
+    forEachCoveredPixel(left, right, bottom, top, [&](int blockX, int blockY) {
+        const int64_t cornerX = FixedEdgeEquation::pixelCenter(blockX), cornerY = FixedEdgeEquation::pixelCenter(blockY);
+        const int64_t extent = (int64_t)(blockSize - 1) * subPixelScale;
+        bool covered = true, outside = false;
+        for (const auto &edge : edges) {
+            const int64_t corner = edge.at(cornerX, cornerY);
+            const int64_t largest = corner + std::max<int64_t>(edge.a, 0) * extent + std::max<int64_t>(edge.b, 0) * extent;
+            const int64_t smallest = corner + std::min<int64_t>(edge.a, 0) * extent + std::min<int64_t>(edge.b, 0) * extent;
+            outside |= largest < edge.threshold;
+            covered &= smallest >= edge.threshold;
+        }
+        if (outside) {
+            return 0ull;
+        }
+        return covered ? ~0ull : blockCoverage(edges, blockX, blockY, kernel);
+    }, [&](int x, int y) {
+        const int64_t centerX = FixedEdgeEquation::pixelCenter(x), centerY = FixedEdgeEquation::pixelCenter(y);
+        shadePixel(v2fs, fs, mat, lights, x, y, (float)edges[1].at(centerX, centerY) * weights[0], (float)edges[2].at(centerX, centerY) * weights[1],
+            (float)edges[0].at(centerX, centerY) * weights[2]);
+    });
+    return true;
+}
+
+void Rasterizer::updateMeshBuffers() {
+    bool changed = false;
+    uint32_t meshCount = 0;
+    for (const auto &model : activeScene->models) {
         glm::mat4 modelTransform{1.0f};
         modelTransform = glm::scale(modelTransform, model.scale);
         modelTransform = glm::translate(modelTransform, model.translate);
-        vs.setModel(modelTransform);
-
         for (const auto &mesh : model.meshes) {
-            std::vector<V2F> v2fs;
-            for (const auto &vertex : mesh.vertices) {
-                A2V a2v;
-                a2v.position = glm::vec4(vertex.position, 1.0f);
-                a2v.albedo = glm::vec4(1.0f);
-                a2v.normal = vertex.normal;
-                a2v.texcoords = vertex.texcoords;
-                a2v.tangent = vertex.tangent;
-                a2v.bitangent = vertex.bitangent;
+            if (meshCount == meshBuffers.size()) {
+                meshBuffers.emplace_back();
+            }
+            MeshBuffer &buffer = meshBuffers[meshCount++];
+            buffer.modelTransform = modelTransform;
+            // the triangles only keep the offsets into the indices, so new contents of the same size change nothing
+            if (buffer.mesh != &mesh || buffer.v2fs.size() != mesh.vertices.size() || buffer.indexCount != mesh.indices.size()) {
+                buffer.mesh = &mesh;
+                buffer.indexCount = mesh.indices.size();
+                buffer.v2fs.resize(mesh.vertices.size());
+                buffer.clipPositions.resize(mesh.vertices.size());
+                buffer.clipCodes.resize(mesh.vertices.size());
+                changed = true;
+            }
+        }
+    }
+    if (meshCount != meshBuffers.size()) {
+        meshBuffers.resize(meshCount);
+        changed = true;
+    }
+    if (!changed) {
+        return;
+    }
+
+    vertexChunks.clear();
+    triangles.clear();
+    for (uint32_t m = 0; m < meshCount; ++m) {
+        const MeshBuffer &buffer = meshBuffers[m];
+        for (uint32_t begin = 0; begin < buffer.v2fs.size(); begin += vertexChunkSize) {
+            vertexChunks.push_back({m, begin, std::min((uint32_t)buffer.v2fs.size(), begin + vertexChunkSize)});
+        }
+        for (uint32_t i = 0; i + 2 < buffer.indexCount; i += 3) {
+            triangles.push_back({m, i});
+        }
+    }
+}
+
+// the planes a clip space vertex is outside of, a vertex is inside a plane when dot(plane, position) >= 0
+enum ClipCode : uint16_t {
+    ClipLeft = 1 << 0,
+    ClipRight = 1 << 1,
+    ClipBottom = 1 << 2,
+    ClipTop = 1 << 3,
+    ClipNear = 1 << 4,
+    GuardLeft = 1 << 5,
+    GuardRight = 1 << 6,
+    GuardBottom = 1 << 7,
+    GuardTop = 1 << 8,
+    // a triangle outside one of these for all its vertices is not seen
+    ClipFrustum = ClipLeft | ClipRight | ClipBottom | ClipTop | ClipNear,
+    // a triangle with a vertex outside one of these is cut by it
+    ClipPlanes = ClipNear | GuardLeft | GuardRight | GuardBottom | GuardTop
+};
+
+static uint16_t clipCode(const glm::vec4 &p) {
+    uint16_t code = 0;
+    const float guard = Rasterizer::guardBand * p.w;
+    code |= p.x < -p.w ? ClipLeft : 0;
+    code |= p.x > p.w ? ClipRight : 0;
+    code |= p.y < -p.w ? ClipBottom : 0;
+    code |= p.y > p.w ? ClipTop : 0;
+    // behind the camera too, w is negative there
+    code |= p.z < -p.w ? ClipNear : 0;
+    code |= p.x < -guard ? GuardLeft : 0;
+    code |= p.x > guard ? GuardRight : 0;
+    code |= p.y < -guard ? GuardBottom : 0;
+    code |= p.y > guard ? GuardTop : 0;
+    return code;
+}
+
+static glm::vec4 clipPlane(uint16_t code) {
+    switch (code) {
+    case ClipNear: return glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+    case GuardLeft: return glm::vec4(1.0f, 0.0f, 0.0f, Rasterizer::guardBand);
+    case GuardRight: return glm::vec4(-1.0f, 0.0f, 0.0f, Rasterizer::guardBand);
+    case GuardBottom: return glm::vec4(0.0f, 1.0f, 0.0f, Rasterizer::guardBand);
+    case GuardTop: return glm::vec4(0.0f, -1.0f, 0.0f, Rasterizer::guardBand);
+    }
+    return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+struct ClipVertex {
+    glm::vec4 clip;
+    V2F v2f;
+};
+
+// the attributes are linear in clip space, so the new vertices interpolate them before the perspective divide
+static ClipVertex lerpClipVertex(const ClipVertex &a, const ClipVertex &b, float t) {
+    ClipVertex vertex;
+    vertex.clip = glm::mix(a.clip, b.clip, t);
+    vertex.v2f.worldPosition = glm::mix(a.v2f.worldPosition, b.v2f.worldPosition, t);
+    vertex.v2f.albedo = glm::mix(a.v2f.albedo, b.v2f.albedo, t);
+    vertex.v2f.normal = glm::mix(a.v2f.normal, b.v2f.normal, t);
+    vertex.v2f.texcoords = glm::mix(a.v2f.texcoords, b.v2f.texcoords, t);
+    vertex.v2f.viewDir = glm::mix(a.v2f.viewDir, b.v2f.viewDir, t);
+    return vertex;
+}
+
+// Sutherland-Hodgman against one plane, from polygon into clipped, returns the vertex count of clipped
+static uint32_t clipPolygon(const ClipVertex *polygon, uint32_t count, const glm::vec4 &plane, ClipVertex *clipped) {
+    uint32_t clippedCount = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const ClipVertex &current = polygon[i], &next = polygon[(i + 1) % count];
+        float currentDistance = glm::dot(plane, current.clip), nextDistance = glm::dot(plane, next.clip);
+        if (currentDistance >= 0.0f) {
+            clipped[clippedCount++] = current;
+        }
+        if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f)) {
+            clipped[clippedCount++] = lerpClipVertex(current, next, currentDistance / (currentDistance - nextDistance));
+        }
+    }
+    return clippedCount;
+}
+
+Rasterizer::Primitive Rasterizer::primitive(const Triangle &triangle) const {
+    const MeshBuffer &buffer = meshBuffers[triangle.meshBuffer];
+    const auto &indices = buffer.mesh->indices;
+    return {&buffer.v2fs[indices[triangle.firstIndex]], &buffer.v2fs[indices[triangle.firstIndex + 1]], &buffer.v2fs[indices[triangle.firstIndex + 2]]};
+}
+
+void Rasterizer::render(const Scene &scene, const Camera &camera) {
+    activeCamera = &camera;
+    activeScene = &scene;
+    uint32_t threadCount = settings.threadCount > 0 ? settings.threadCount : ThreadPool::hardwareThreads();
+    if (threadPool.threadCount() != threadCount) {
+        threadPool.resize(threadCount);
+    }
+    stats.threadCount = threadCount;
+    updateTiles();
+
+    Timer timer;
+    updateMeshBuffers();
+    // every chunk writes its own range of the vertices of one mesh
+    threadPool.parallelFor((uint32_t)vertexChunks.size(), [this, &camera](uint32_t c, uint32_t) {
+        const VertexChunk &chunk = vertexChunks[c];
+        MeshBuffer &buffer = meshBuffers[chunk.meshBuffer];
+        BasicVertexShader vs;
+        // set view and projection transformation matrix in vs
+        vs.setView(camera.getView());
+        vs.setProjection(camera.getProjection());
+        vs.setModel(buffer.modelTransform);
+        for (uint32_t i = chunk.begin; i < chunk.end; ++i) {
+            const Vertex &vertex = buffer.mesh->vertices[i];
+            A2V a2v;
+            a2v.position = glm::vec4(vertex.position, 1.0f);
+            a2v.albedo = glm::vec4(1.0f);
+            a2v.normal = vertex.normal;
+            a2v.texcoords = vertex.texcoords;
+            a2v.tangent = vertex.tangent;
+            a2v.bitangent = vertex.bitangent;
+
+            V2F &v2f = buffer.v2fs[i];
+            v2f = vs.vert(a2v);
+            buffer.clipPositions[i] = v2f.position;
+            buffer.clipCodes[i] = clipCode(v2f.position);
+            // meaningless for a vertex behind the camera, the triangles with one are clipped before they use it
+            float w = v2f.position.w;
+            v2f.position /= w;
+            v2f.position = camera.getViewportTransform() * v2f.position;
+            v2f.position.w = w;
+
+            v2f.viewDir = v2f.worldPosition - camera.getPosition();
+        }
+    });
+    stats.vertexCount = 0;
+    for (const auto &chunk : vertexChunks) {
+        stats.vertexCount += chunk.end - chunk.begin;
+    }
+    stats.triangleCount = (uint32_t)triangles.size();
+    stats.geometryTimeMs = timer.elapsedMs();
 
-                v2fs.emplace_back(vs.vert(a2v));
-                auto &v2f = v2fs.back();
-                float w = v2f.position.w;
-                v2f.position /= w;
-                v2f.position = camera.getViewportTransform() * v2f.position;
-                v2f.position.w = w;
+    // every chunk bins its triangles into its own row of bins, so the threads never share a bin
+    timer.reset();
+    const uint32_t width = image->getWidth(), height = image->getHeight();
+    const uint32_t tileCount = (uint32_t)tiles.size();
+    const uint32_t chunkCount = (uint32_t)((triangles.size() + binChunkSize - 1) / binChunkSize);
+    if (bins.size() < (size_t)chunkCount * tileCount) {
+        bins.resize((size_t)chunkCount * tileCount);
+    }
+    if (clipBuffers.size() < chunkCount) {
+        clipBuffers.resize(chunkCount);
+    }
+    std::atomic<uint32_t> rejectedCount{0}, clippedCount{0};
+    const glm::mat4 &viewportTransform = camera.getViewportTransform();
+    threadPool.parallelFor(chunkCount, [this, width, height, tileCount, &viewportTransform, &rejectedCount, &clippedCount](uint32_t chunk, uint32_t) {
+        std::vector<uint32_t> *chunkBins = &bins[(size_t)chunk * tileCount];
+        for (uint32_t t = 0; t < tileCount; ++t) {
+            chunkBins[t].clear();
+        }
+        ClipBuffer &clipBuffer = clipBuffers[chunk];
+        clipBuffer.v2fs.clear();
+        clipBuffer.meshBuffers.clear();
+        auto bin = [&](const Primitive &v2fs, uint32_t entry) {
+            int left, right, bottom, top;
+            screenBounds(v2fs, (int)width, (int)height, left, right, bottom, top);
+            if (left > right || bottom > top) {
+                return;
+            }
+            for (uint32_t ty = bottom / tileSize; ty <= top / tileSize; ++ty) {
+                for (uint32_t tx = left / tileSize; tx <= right / tileSize; ++tx) {
+                    chunkBins[tx + ty * tileColumns].push_back(entry);
+                }
+            }
+        };
 
-                v2f.viewDir = v2f.worldPosition - camera.getPosition();
+        uint32_t rejected = 0, clipped = 0;
+        const uint32_t end = std::min((uint32_t)triangles.size(), (chunk + 1) * binChunkSize);
+        for (uint32_t i = chunk * binChunkSize; i < end; ++i) {
+            const Triangle &triangle = triangles[i];
+            const MeshBuffer &buffer = meshBuffers[triangle.meshBuffer];
+            const uint32_t indices[3] = {buffer.mesh->indices[triangle.firstIndex], buffer.mesh->indices[triangle.firstIndex + 1],
+                buffer.mesh->indices[triangle.firstIndex + 2]};
+            const uint16_t codes[3] = {buffer.clipCodes[indices[0]], buffer.clipCodes[indices[1]], buffer.clipCodes[indices[2]]};
+            if (codes[0] & codes[1] & codes[2] & ClipFrustum) {
+                ++rejected;
+                continue;
             }
-            int numIndices = (int)mesh.indices.size();
-            for (int i = 0; i + 2 < numIndices; i += 3) {
-                std::array<V2F, 3> primitive{v2fs[mesh.indices[i]], v2fs[mesh.indices[i + 1]], v2fs[mesh.indices[i + 2]]};
-                const auto &mat = mesh.mat;
-                rasterize(primitive, fs, mat, scene.lights);
+            const uint16_t planes = (codes[0] | codes[1] | codes[2]) & ClipPlanes;
+            if (!planes) {
+                bin(primitive(triangle), i);
+                continue;
+            }
+
+            // a triangle cut by all five planes has at most eight corners
+            ClipVertex polygons[2][9];
+            uint32_t count = 3;
+            for (uint32_t k = 0; k < 3; ++k) {
+                polygons[0][k] = {buffer.clipPositions[indices[k]], buffer.v2fs[indices[k]]};
+            }
+            int current = 0;
+            for (uint16_t plane = ClipNear; plane <= GuardTop && count >= 3; plane <<= 1) {
+                if (planes & plane) {
+                    count = clipPolygon(polygons[current], count, clipPlane(plane), polygons[1 - current]);
+                    current = 1 - current;
+                }
+            }
+            ++clipped;
+            if (count < 3) {
+                continue;
+            }
+            V2F corners[9];
+            for (uint32_t k = 0; k < count; ++k) {
+                const ClipVertex &vertex = polygons[current][k];
+                corners[k] = vertex.v2f;
+                float w = vertex.clip.w;
+                corners[k].position = viewportTransform * (vertex.clip / w);
+                corners[k].position.w = w;
+            }
+            // a fan keeps the winding of the triangle, so the back faces stay culled
+            for (uint32_t k = 1; k + 1 < count; ++k) {
+                const uint32_t clippedIndex = (uint32_t)clipBuffer.meshBuffers.size();
+                clipBuffer.v2fs.insert(clipBuffer.v2fs.end(), {corners[0], corners[k], corners[k + 1]});
+                clipBuffer.meshBuffers.push_back(triangle.meshBuffer);
+                bin({&corners[0], &corners[k], &corners[k + 1]}, clippedBit | clippedIndex);
+            }
+        }
+        rejectedCount += rejected;
+        clippedCount += clipped;
+    });
+    stats.rejectedCount = rejectedCount;
+    stats.clippedCount = clippedCount;
+    stats.binTimeMs = timer.elapsedMs();
+
+    // the chunks are walked in order, so each tile draws its triangles in the order they were submitted
+    timer.reset();
+    std::atomic<uint32_t> binnedCount{0};
+    threadPool.parallelFor(tileCount, [this, width, tileCount, chunkCount, &scene, &binnedCount](uint32_t t, uint32_t) {
+        const Tile &tile = tiles[t];
+        // clear buffer
+        for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+            std::fill_n(colorBuffer.begin() + y * width + tile.x, tile.width, glm::vec4(0, 0, 0, 1));
+            std::fill_n(depthBuffer.begin() + y * width + tile.x, tile.width, std::numeric_limits<float>::max());
+        }
+        BasicFragmentShader fs;
+        uint32_t count = 0;
+        for (uint32_t chunk = 0; chunk < chunkCount; ++chunk) {
+            const ClipBuffer &clipBuffer = clipBuffers[chunk];
+            for (uint32_t i : bins[(size_t)chunk * tileCount + t]) {
+                if (i & clippedBit) {
+                    const uint32_t clipped = i & ~clippedBit;
+                    const V2F *v2fs = &clipBuffer.v2fs[clipped * 3];
+                    rasterize({v2fs, v2fs + 1, v2fs + 2}, fs, meshBuffers[clipBuffer.meshBuffers[clipped]].mesh->mat, scene.lights, tile);
+                    continue;
+                }
+                rasterize(primitive(triangles[i]), fs, meshBuffers[triangles[i].meshBuffer].mesh->mat, scene.lights, tile);
+            }
+            count += (uint32_t)bins[(size_t)chunk * tileCount + t].size();
+        }
+        for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+            for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+                imageData[x + y * width] = Utils::glmVec4ToUint32t(colorBuffer[x + y * width]);
             }
         }
+        binnedCount += count;
+    });
+    stats.binnedCount = binnedCount;
+    stats.rasterTimeMs = timer.elapsedMs();
+    image->setData(imageData);
+}
+
+void Rasterizer::benchmarkTriangleSizes(const Camera &camera) {
+    stats.triangleSizeBenchmark.clear();
+    if (!image) {
+        return;
     }
-    for (uint32_t i = 0; i < image->getWidth() * image->getHeight(); ++i) {
-        imageData[i] = Utils::glmVec4ToUint32t(colorBuffer[i]);
+    activeCamera = &camera;
+    const uint32_t width = image->getWidth(), height = image->getHeight();
+    const Tile screen{0, 0, width, height};
+    const Material material;
+    const std::vector<DirectionLight> lights;
+    BasicFragmentShader fs;
+    for (uint32_t size : {1u, 4u, 16u, 64u, 256u}) {
+        if (size >= width || size >= height) {
+            break;
+        }
+        // right triangles with legs of size pixels, counterclockwise like the front faces, all at the same depth so none is hidden
+        const uint32_t count = (uint32_t)std::clamp<uint64_t>(triangleSizeBenchmarkPixels * 2 / ((uint64_t)size * size), 16, 1000000);
+        std::vector<std::array<V2F, 3>> primitives(count);
+        PCG rng(size);
+        for (auto &primitive : primitives) {
+            float x = (float)(rng.UInt() % (width - size)), y = (float)(rng.UInt() % (height - size));
+            const glm::vec2 corners[3] = {{x, y}, {x + size, y}, {x, y + size}};
+            for (int k = 0; k < 3; ++k) {
+                primitive[k] = V2F{};
+                primitive[k].position = glm::vec4(corners[k].x, corners[k].y, 0.0f, 1.0f);
+                primitive[k].albedo = glm::vec4(1.0f);
+                primitive[k].normal = glm::vec3(0.0f, 0.0f, 1.0f);
+            }
+        }
+
+        auto run = [&](const char *name, bool fixedPoint, auto &&draw) {
+            std::fill(colorBuffer.begin(), colorBuffer.end(), glm::vec4(0, 0, 0, 1));
+            std::fill(depthBuffer.begin(), depthBuffer.end(), std::numeric_limits<float>::max());
+            Timer timer;
+            for (const auto &primitive : primitives) {
+                draw({&primitive[0], &primitive[1], &primitive[2]});
+            }
+            stats.triangleSizeBenchmark.push_back({name, fixedPoint, size, count, (uint64_t)count * size * (size + 1) / 2, timer.elapsedMs()});
+        };
+        run("bounding box", false, [&](const Primitive &v2fs) {
+            rasterizeBoundingBox(v2fs, fs, material, lights, screen);
+        });
+        const Settings savedSettings = settings;
+        for (bool fixedPoint : {false, true}) {
+            for (auto kernel : {CoverageKernel::Scalar, CoverageKernel::SSE, CoverageKernel::AVX2}) {
+                if (!isKernelSupported(kernel)) {
+                    continue;
+                }
+                settings.fixedPoint = fixedPoint;
+                settings.coverageKernel = kernel;
+                run(kernelName(kernel), fixedPoint, [&](const Primitive &v2fs) {
+                    rasterize(v2fs, fs, material, lights, screen);
+                });
+            }
+        }
+        settings = savedSettings;
     }
-    image->setData(imageData);
+}
+
+bool Rasterizer::isKernelSupported(CoverageKernel kernel) {
+    switch (kernel) {
+        case CoverageKernel::SSE:
+            return SIMD_SSE;
+        case CoverageKernel::AVX2:
+            return SIMD_AVX2;
+        default:
+            return true;
+    }
+}
+
+const char *Rasterizer::kernelName(CoverageKernel kernel) {
+    switch (kernel) {
+        case CoverageKernel::SSE:
+            return "sse";
+        case CoverageKernel::AVX2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
+
+void Rasterizer::benchmarkScaling(const Scene &scene, const Camera &camera) {
+    stats.scalingBenchmark.clear();
+    if (!image) {
+        return;
+    }
+    const uint32_t savedThreadCount = settings.threadCount;
+    const uint32_t maxThreads = ThreadPool::hardwareThreads();
+    float singleThreadMs = 0.0f;
+    for (uint32_t threads = 1;; threads = std::min(threads * 2, maxThreads)) {
+        settings.threadCount = threads;
+        // the first frame grows the bins and starts the threads
+        render(scene, camera);
+        float bestMs = std::numeric_limits<float>::max();
+        for (uint32_t i = 0; i < scalingBenchmarkFrames; ++i) {
+            Timer timer;
+            render(scene, camera);
+            bestMs = std::min(bestMs, timer.elapsedMs());
+        }
+        if (threads == 1) {
+            singleThreadMs = bestMs;
+        }
+        stats.scalingBenchmark.push_back({threads, bestMs, bestMs > 0.0f ? singleThreadMs / bestMs : 0.0f});
+        if (threads == maxThreads) {
+            break;
+        }
+    }
+    settings.threadCount = savedThreadCount;
 }
\ No newline at end of file
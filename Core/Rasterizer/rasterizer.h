@@ -3,18 +3,123 @@
 #include "camera.h"
 #include "scene.h"
 #include "shader.h"
+#include "threadpool.h"
+#include "simd.h"
 
 #include <memory>
 #include <vector>
 #include <array>
 #include <glm/glm.hpp>
 
-class Rasterizer {
-private:
+// how many pixels of a block the coverage test evaluates at once
+enum class CoverageKernel { Scalar, SSE, AVX2 };
 
+// Sort middle: the vertices of every mesh are transformed in parallel chunks, the triangles are binned into screen tiles in draw
+// order, then every tile is rasterized by one thread, which owns its part of the color and depth buffers.
+class Rasterizer {
 public:
+    struct Settings {
+        // 0 uses every hardware thread
+        uint32_t threadCount = 0;
+        // the screen is split into tileSize x tileSize tiles
+        uint32_t tileSize = 64;
+        CoverageKernel coverageKernel = SIMD_AVX2 ? CoverageKernel::AVX2 : SIMD_SSE ? CoverageKernel::SSE : CoverageKernel::Scalar;
+        // snap the vertices to a 1 / subPixelScale grid and sample the pixel centers with the top-left rule, so the pixels of an edge
+        // shared by two triangles are shaded once. Otherwise the float edge functions are sampled at the pixel corners
+        bool fixedPoint = true;
+    };
+
+    struct ScalingBenchmarkResult {
+        uint32_t threadCount;
+        float timeMs;
+        // against one thread
+        float speedup;
+    };
+
+    struct TriangleSizeBenchmarkResult {
+        const char *name;
+        bool fixedPoint;
+        // the legs of the right triangles in pixels
+        uint32_t size;
+        uint32_t triangles;
+        uint64_t pixels;
+        float timeMs;
+    };
+
+    struct Stats {
+        uint32_t threadCount = 0;
+        uint32_t vertexCount = 0;
+        uint32_t triangleCount = 0;
+        // a triangle is counted once for every tile its bounds overlap
+        uint32_t binnedCount = 0;
+        // outside one plane of the view frustum or behind the camera
+        uint32_t rejectedCount = 0;
+        // cut by the near plane or the guard band
+        uint32_t clippedCount = 0;
+        float geometryTimeMs = 0.0f;
+        float binTimeMs = 0.0f;
+        float rasterTimeMs = 0.0f;
+        std::vector<ScalingBenchmarkResult> scalingBenchmark;
+        std::vector<TriangleSizeBenchmarkResult> triangleSizeBenchmark;
+    };
+
+    // vertices transformed as one task
+    static constexpr uint32_t vertexChunkSize = 4096;
+    // triangles binned as one task, the bins of a chunk hold its triangles in draw order
+    static constexpr uint32_t binChunkSize = 4096;
+    // triangles within this many times the viewport around its center are rasterized without clipping, their pixels outside the
+    // viewport are skipped by the bounds of the tiles. Only the near plane and the edge of the guard band cut triangles
+    static constexpr float guardBand = 8.0f;
+    // a bin entry with this bit refers to the clipped triangles of its chunk
+    static constexpr uint32_t clippedBit = 1u << 31;
+    // the triangles are walked in blockSize x blockSize pixel blocks, which are skipped or filled whole when no edge crosses them
+    static constexpr uint32_t blockSize = 8;
+    // the vertices are snapped to 1 / 2^subPixelBits of a pixel in fixed point rasterization
+    static constexpr uint32_t subPixelBits = 8;
+    static constexpr int64_t subPixelScale = 1ll << subPixelBits;
+    // larger vertex coordinates on the sub-pixel grid are rasterized in floats, that is 65536 pixels, well past the guard band
+    static constexpr int64_t fixedPointRange = 1ll << 24;
+    // the triangle size benchmark draws about this many pixels for every size
+    static constexpr uint64_t triangleSizeBenchmarkPixels = 4000000;
+    // the scaling benchmark keeps the fastest of this many frames for every thread count
+    static constexpr uint32_t scalingBenchmarkFrames = 5;
 
 private: 
+    // the post transform vertices of one mesh, kept between frames so that they are only allocated when the mesh changes
+    struct MeshBuffer {
+        const Mesh *mesh = nullptr;
+        size_t indexCount = 0;
+        glm::mat4 modelTransform{1.0f};
+        std::vector<V2F> v2fs;
+        // before the perspective divide, and which planes each vertex is outside of
+        std::vector<glm::vec4> clipPositions;
+        std::vector<uint16_t> clipCodes;
+    };
+
+    // the triangles one bin chunk made by clipping, three vertices each
+    struct ClipBuffer {
+        std::vector<V2F> v2fs;
+        std::vector<uint32_t> meshBuffers;
+    };
+
+    struct VertexChunk {
+        uint32_t meshBuffer;
+        uint32_t begin, end;
+    };
+
+    // the vertices are looked up through the indices of the mesh
+    struct Triangle {
+        uint32_t meshBuffer;
+        uint32_t firstIndex;
+    };
+
+    using Primitive = std::array<const V2F *, 3>;
+
+    struct Tile {
+        uint32_t x, y;
+        uint32_t width, height;
+    };
+
     std::shared_ptr<Image> image;
     uint32_t *imageData = nullptr;
 
@@ -24,13 +129,52 @@ private:
     const Camera *activeCamera = nullptr;
     const Scene *activeScene = nullptr;
 
+    ThreadPool threadPool;
+    std::vector<Tile> tiles;
+    uint32_t tileColumns = 0;
+    // the tile size and image size the tiles were made for
+    uint32_t tileSize = 0;
+    uint32_t tiledWidth = 0, tiledHeight = 0;
+    // every mesh of the scene in draw order
+    std::vector<MeshBuffer> meshBuffers;
+    // made again only when the meshes change
+    std::vector<VertexChunk> vertexChunks;
+    std::vector<Triangle> triangles;
+    // the triangles of chunk c which overlap tile t are in bins[c * tiles.size() + t], kept between frames so they are only allocated once
+    std::vector<std::vector<uint32_t>> bins;
+    std::vector<ClipBuffer> clipBuffers;
+
 public:
+    Settings settings;
+    Stats stats;
 
 private:
-    void rasterize(std::array<V2F, 3> &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights);
+    void updateTiles();
+    // match meshBuffers to the meshes of the scene and take their model transforms
+    void updateMeshBuffers();
+    Primitive primitive(const Triangle &triangle) const;
+    // the part of the triangle inside tile
+    void rasterize(const Primitive &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights, const Tile &tile);
+    // rasterize() in fixed point within the pixel bounds, false when the triangle is too large for it
+    bool rasterizeFixedPoint(const Primitive &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights,
+        int left, int right, int bottom, int top);
+    // the cross products of every pixel of the bounds that rasterize() used before, the baseline of the triangle size benchmark
+    void rasterizeBoundingBox(const Primitive &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights, const Tile &tile);
+    // depth test and shade a covered pixel, alpha, beta and gamma are the barycentrics divided by the w of their vertex
+    void shadePixel(const Primitive &v2fs, BasicFragmentShader &fs, const Material &mat, const std::vector<DirectionLight> &lights,
+        int x, int y, float alpha, float beta, float gamma);
 public:
     void resize(uint32_t width, uint32_t height);
     void render(const Scene &scene, const Camera &camera);
 
+    // render the scene with 1, 2, 4, ... threads up to every hardware thread
+    void benchmarkScaling(const Scene &scene, const Camera &camera);
+    // draw random screen space triangles of several sizes on one thread with every coverage kernel in floats and fixed point and the
+    // bounding box baseline
+    void benchmarkTriangleSizes(const Camera &camera);
+
+    static bool isKernelSupported(CoverageKernel kernel);
+    static const char *kernelName(CoverageKernel kernel);
+
     std::shared_ptr<Image> getImage() const { return image; }
 };
\ No newline at end of file
@@ -0,0 +1,41 @@
+#include "aliastable.h"
+
+void AliasTable::build(const std::vector<float> &weights) {
+    entries.clear();
+    double sum = 0.0;
+    for (float weight : weights) {
+        sum += weight;
+    }
+    weightSum = (float)sum;
+    if (weights.empty() || sum <= 0.0) {
+        return;
+    }
+
+    const size_t n = weights.size();
+    entries.resize(n);
+    // each bucket holds 1 on average, the ones below fill up from those above
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; ++i) {
+        scaled[i] = weights[i] * n / sum;
+        (scaled[i] < 1.0 ? small : large).push_back((uint32_t)i);
+    }
+    while (!small.empty() && !large.empty()) {
+        uint32_t less = small.back();
+        small.pop_back();
+        uint32_t more = large.back();
+        entries[less] = {(float)scaled[less], more};
+        scaled[more] -= 1.0 - scaled[less];
+        if (scaled[more] < 1.0) {
+            large.pop_back();
+            small.push_back(more);
+        }
+    }
+    // what is left is full up to rounding
+    for (uint32_t i : small) {
+        entries[i] = {1.0f, i};
+    }
+    for (uint32_t i : large) {
+        entries[i] = {1.0f, i};
+    }
+}
\ No newline at end of file
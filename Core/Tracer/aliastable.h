@@ -0,0 +1,31 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+// Picks index i with the probability weights[i] / sum in constant time, Vose's alias method.
+class AliasTable {
+private:
+    struct Entry {
+        // chance to keep the bucket, alias is taken otherwise
+        float probability;
+        uint32_t alias;
+    };
+    std::vector<Entry> entries;
+    float weightSum = 0.0f;
+
+public:
+    // weights are >= 0, the table is empty when they are all 0
+    void build(const std::vector<float> &weights);
+
+    bool empty() const { return entries.empty(); }
+    size_t size() const { return entries.size(); }
+    float sum() const { return weightSum; }
+
+    // bucketU and coinU in [0, 1), two independent numbers so the coin keeps its full precision with many buckets
+    uint32_t sample(float bucketU, float coinU) const {
+        uint32_t i = std::min((uint32_t)(bucketU * (float)entries.size()), (uint32_t)entries.size() - 1);
+        return coinU < entries[i].probability ? i : entries[i].alias;
+    }
+};
\ No newline at end of file
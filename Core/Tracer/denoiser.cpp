@@ -0,0 +1,516 @@
+#include "denoiser.h"
+#include "utils.hpp"
+#include "simd.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+// exp(-x) for x >= 0 within 0.2%, 2^-t as 2^-i times a polynomial for 2^-f. No branches, so that the loops calling it vectorize
+static inline float expNegative(float x) {
+    float t = std::min(x * 1.44269504f, 100.0f);
+    int i = (int)t;
+    float f = t - (float)i;
+    float p = 1.0f + f * (-0.69314718f + f * (0.24022651f + f * (-0.05550411f + f * 0.00961813f)));
+    int32_t bits = (127 - i) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(float));
+    return p * scale;
+}
+
+// whether two pixels a few apart see the same surface, the sky matches nothing
+static inline bool sameSurface(float depthA, const glm::vec3 &normalA, float depthB, const glm::vec3 &normalB, float depthTolerance) {
+    return depthA > 0.0f && depthB > 0.0f && std::abs(depthA - depthB) <= depthTolerance * depthA && glm::dot(normalA, normalB) >= 0.9f;
+}
+
+namespace {
+// the full resolution image the last iteration writes
+struct Frame {
+    const glm::vec4 *accumulation;
+    const uint32_t *sampleCounts;
+    const Denoiser::Guides *guides;
+    uint32_t *output;
+    int width, height;
+    float depthTolerance;
+};
+
+// the planes one iteration of one row reads and writes, all at half resolution
+struct RowPass {
+    const float *r, *g, *b, *variance, *luminance;
+    const float *normalX, *normalY, *normalZ, *depth;
+    const uint8_t *surfaceMasks;
+    float *outR, *outG, *outB, *outVariance, *outLuminance;
+    // the first iteration estimates the variance of the pixels marked with -1 from these, they are not read afterwards
+    const float *rowCovered, *rowLuminance, *rowLuminanceSquares;
+    // set in the last iteration, which writes the image instead of the out planes
+    const Frame *frame;
+    int width, height;
+    int y;
+    // the first pixel of the row
+    int row;
+    int step;
+    // the first pixel of the row of each tap, a row outside the image points at the center row and has no weight
+    int tapRows[3];
+    float rowKernel[3];
+    float colorPhi;
+    // depthPhi per full resolution pixel of step
+    float depthPhi;
+    float normalPower;
+};
+}
+
+// b-spline
+static const float bSpline[3] = {0.25f, 0.5f, 0.25f};
+static const float centerKernel = bSpline[1] * bSpline[1];
+// a pixel with fewer samples has no usable variance of its own (svgf)
+static const uint32_t varianceSamples = 4;
+
+// the variance of the luminance over the covered pixels of the 7x7 block around x, for the pixels with few samples
+static float spatialVariance(const RowPass &pass, int x) {
+    float covered = 0.0f, sum = 0.0f, sumSquares = 0.0f;
+    for (int qy = std::max(pass.y - 3, 0); qy <= std::min(pass.y + 3, pass.height - 1); ++qy) {
+        const int q = qy * pass.width + x;
+        covered += pass.rowCovered[q];
+        sum += pass.rowLuminance[q];
+        sumSquares += pass.rowLuminanceSquares[q];
+    }
+    const float inverseCovered = 1.0f / std::max(covered, 1.0f);
+    const float mean = sum * inverseCovered;
+    return std::max(sumSquares * inverseCovered - mean * mean, 0.0f);
+}
+
+static inline float centerVariance(const RowPass &pass, int x) {
+    const float variance = pass.variance[pass.row + x];
+    return variance >= 0.0f ? variance : spatialVariance(pass, x);
+}
+
+// the last iteration: the pixels of the 2x2 block of x take its filtered illumination times their own albedo. A pixel on another
+// surface than the block takes the illumination of a neighbouring block on its own from the previous iteration, or keeps its mean
+static void writeOutput(const RowPass &pass, int x, float r, float g, float b) {
+    const Frame &frame = *pass.frame;
+    const int p = pass.row + x;
+    for (int sy = 0; sy < 2 && pass.y * 2 + sy < frame.height; ++sy) {
+        for (int sx = 0; sx < 2 && x * 2 + sx < frame.width; ++sx) {
+            const int i = (pass.y * 2 + sy) * frame.width + x * 2 + sx;
+            const glm::vec3 albedo = glm::max(frame.guides->albedo[i], glm::vec3(0.001f));
+            glm::vec3 color;
+            if (pass.surfaceMasks[p] & (1 << (sy * 2 + sx))) {
+                color = glm::vec3(r, g, b) * albedo;
+            }
+            else {
+                const float pixelDepth = frame.guides->depth[i];
+                const glm::vec3 &pixelNormal = frame.guides->normal[i];
+                color = glm::vec3(frame.accumulation[i]) * (1.0f / (float)std::max(frame.sampleCounts[i], 1u));
+                // the blocks next to the pixel, the sky matches none and keeps its mean
+                const int neighbourX = x + (sx == 0 ? -1 : 1), neighbourY = pass.y + (sy == 0 ? -1 : 1);
+                const int neighbours[3][2] = {{neighbourX, pass.y}, {x, neighbourY}, {neighbourX, neighbourY}};
+                for (const auto &neighbour : neighbours) {
+                    if (neighbour[0] < 0 || neighbour[0] >= pass.width || neighbour[1] < 0 || neighbour[1] >= pass.height) {
+                        continue;
+                    }
+                    const int q = neighbour[1] * pass.width + neighbour[0];
+                    if (sameSurface(pixelDepth, pixelNormal, pass.depth[q], glm::vec3(pass.normalX[q], pass.normalY[q], pass.normalZ[q]),
+                        frame.depthTolerance)) {
+                        color = glm::vec3(pass.r[q], pass.g[q], pass.b[q]) * albedo;
+                        break;
+                    }
+                }
+            }
+            frame.output[i] = Utils::glmVec4ToUint32t(glm::vec4(glm::clamp(color, glm::vec3(0.0f), glm::vec3(1.0f)), 1.0f));
+        }
+    }
+}
+
+static inline void storePixel(const RowPass &pass, int x, float r, float g, float b, float variance) {
+    if (pass.frame) {
+        writeOutput(pass, x, r, g, b);
+        return;
+    }
+    const int p = pass.row + x;
+    pass.outR[p] = r;
+    pass.outG[p] = g;
+    pass.outB[p] = b;
+    pass.outVariance[p] = variance;
+    pass.outLuminance[p] = Utils::luminance(glm::vec3(r, g, b));
+}
+
+// one pixel, the taps outside the image are left out
+static void filterPixel(const RowPass &pass, int x) {
+    const int p = pass.row + x;
+    const float variance = centerVariance(pass, x);
+    const float luminanceScale = 1.0f / (pass.colorPhi * std::sqrt(variance) + 1e-4f);
+    const float depthScale = pass.depth[p] > 0.0f ? 1.0f / (pass.depth[p] * pass.depthPhi) : 0.0f;
+    // the center tap matches itself, its weight is only the kernel
+    const float center = pass.depth[p] > 0.0f ? centerKernel : 0.0f;
+    float sumR = center * pass.r[p], sumG = center * pass.g[p], sumB = center * pass.b[p], sumVariance = center * center * variance, sumWeight = center;
+    for (int ky = 0; ky < 3; ++ky) {
+        for (int kx = 0; kx < 3; ++kx) {
+            const int qx = x + (kx - 1) * pass.step;
+            if ((kx == 1 && ky == 1) || qx < 0 || qx >= pass.width) {
+                continue;
+            }
+            const int q = pass.tapRows[ky] + qx;
+            const float cosine = pass.normalX[p] * pass.normalX[q] + pass.normalY[p] * pass.normalY[q] + pass.normalZ[p] * pass.normalZ[q];
+            // one exp for the three edge stopping weights, cos^n is close to exp(-n * (1 - cos)) where it is not 0 anyway
+            const float exponent = std::abs(pass.luminance[p] - pass.luminance[q]) * luminanceScale + std::abs(pass.depth[p] - pass.depth[q]) * depthScale +
+                pass.normalPower * (1.0f - cosine);
+            // the sky is left out
+            const float covered = pass.depth[q] > 0.0f ? 1.0f : 0.0f;
+            const float weight = pass.rowKernel[ky] * bSpline[kx] * covered * expNegative(std::max(exponent, 0.0f));
+            // the 7x7 blocks of the first iteration's taps are nearly the center's, so a tap with few samples takes its variance
+            const float tapVariance = pass.variance[q] >= 0.0f ? pass.variance[q] : variance;
+            sumR += weight * pass.r[q];
+            sumG += weight * pass.g[q];
+            sumB += weight * pass.b[q];
+            sumVariance += weight * weight * tapVariance;
+            sumWeight += weight;
+        }
+    }
+
+    if (pass.depth[p] <= 0.0f || sumWeight <= 0.0f) {
+        // the sky has no noise
+        storePixel(pass, x, pass.r[p], pass.g[p], pass.b[p], variance);
+        return;
+    }
+    const float inverseWeight = 1.0f / sumWeight;
+    storePixel(pass, x, sumR * inverseWeight, sumG * inverseWeight, sumB * inverseWeight, sumVariance * inverseWeight * inverseWeight);
+}
+
+#if SIMD_AVX2
+static inline __m256 expNegative8(__m256 x) {
+    const __m256 t = _mm256_min_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _mm256_set1_ps(100.0f));
+    const __m256i i = _mm256_cvttps_epi32(t);
+    const __m256 f = _mm256_sub_ps(t, _mm256_cvtepi32_ps(i));
+    __m256 p = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.00961813f), f), _mm256_set1_ps(-0.05550411f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.24022651f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(-0.69314718f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(1.0f));
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_sub_epi32(_mm256_set1_epi32(127), i), 23)));
+}
+
+// centerVariance() for the 8 pixels from x, the spatial estimate only runs when one of them needs it
+static inline __m256 centerVariance8(const RowPass &pass, int x) {
+    const __m256 variance = _mm256_loadu_ps(pass.variance + pass.row + x);
+    const __m256 few = _mm256_cmp_ps(variance, _mm256_setzero_ps(), _CMP_LT_OQ);
+    if (_mm256_movemask_ps(few) == 0) {
+        return variance;
+    }
+    __m256 covered = _mm256_setzero_ps(), sum = _mm256_setzero_ps(), sumSquares = _mm256_setzero_ps();
+    for (int qy = std::max(pass.y - 3, 0); qy <= std::min(pass.y + 3, pass.height - 1); ++qy) {
+        const int q = qy * pass.width + x;
+        covered = _mm256_add_ps(covered, _mm256_loadu_ps(pass.rowCovered + q));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(pass.rowLuminance + q));
+        sumSquares = _mm256_add_ps(sumSquares, _mm256_loadu_ps(pass.rowLuminanceSquares + q));
+    }
+    const __m256 inverseCovered = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_max_ps(covered, _mm256_set1_ps(1.0f)));
+    const __m256 mean = _mm256_mul_ps(sum, inverseCovered);
+    const __m256 spatial = _mm256_max_ps(_mm256_sub_ps(_mm256_mul_ps(sumSquares, inverseCovered), _mm256_mul_ps(mean, mean)), _mm256_setzero_ps());
+    return _mm256_blendv_ps(variance, spatial, few);
+}
+
+// filterPixel() for the 8 pixels from x, all of their taps must be inside the row
+static void filterPixels8(const RowPass &pass, int x) {
+    const int p = pass.row + x;
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    const __m256 depthP = _mm256_loadu_ps(pass.depth + p), luminanceP = _mm256_loadu_ps(pass.luminance + p);
+    const __m256 normalXP = _mm256_loadu_ps(pass.normalX + p), normalYP = _mm256_loadu_ps(pass.normalY + p), normalZP = _mm256_loadu_ps(pass.normalZ + p);
+    const __m256 variance = centerVariance8(pass, x);
+    const __m256 luminanceScale = _mm256_div_ps(one,
+        _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(pass.colorPhi), _mm256_sqrt_ps(variance)), _mm256_set1_ps(1e-4f)));
+    const __m256 sky = _mm256_cmp_ps(depthP, zero, _CMP_LE_OQ);
+    const __m256 depthScale = _mm256_andnot_ps(sky, _mm256_div_ps(one, _mm256_mul_ps(depthP, _mm256_set1_ps(pass.depthPhi))));
+    const __m256 normalPower = _mm256_set1_ps(pass.normalPower);
+    const __m256 center = _mm256_and_ps(_mm256_cmp_ps(depthP, zero, _CMP_GT_OQ), _mm256_set1_ps(centerKernel));
+    __m256 sumR = _mm256_mul_ps(center, _mm256_loadu_ps(pass.r + p)), sumG = _mm256_mul_ps(center, _mm256_loadu_ps(pass.g + p)), sumB = _mm256_mul_ps(center, _mm256_loadu_ps(pass.b + p));
+    __m256 sumVariance = _mm256_mul_ps(_mm256_mul_ps(center, center), variance), sumWeight = center;
+    for (int ky = 0; ky < 3; ++ky) {
+        for (int kx = 0; kx < 3; ++kx) {
+            if (kx == 1 && ky == 1) {
+                continue;
+            }
+            const int q = pass.tapRows[ky] + x + (kx - 1) * pass.step;
+            const __m256 depthQ = _mm256_loadu_ps(pass.depth + q);
+            const __m256 cosine = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(normalXP, _mm256_loadu_ps(pass.normalX + q)),
+                _mm256_mul_ps(normalYP, _mm256_loadu_ps(pass.normalY + q))), _mm256_mul_ps(normalZP, _mm256_loadu_ps(pass.normalZ + q)));
+            __m256 exponent = _mm256_mul_ps(_mm256_and_ps(absMask, _mm256_sub_ps(luminanceP, _mm256_loadu_ps(pass.luminance + q))), luminanceScale);
+            exponent = _mm256_add_ps(exponent, _mm256_mul_ps(_mm256_and_ps(absMask, _mm256_sub_ps(depthP, depthQ)), depthScale));
+            exponent = _mm256_max_ps(_mm256_add_ps(exponent, _mm256_mul_ps(normalPower, _mm256_sub_ps(one, cosine))), zero);
+            const __m256 covered = _mm256_cmp_ps(depthQ, zero, _CMP_GT_OQ);
+            const __m256 weight = _mm256_and_ps(covered, _mm256_mul_ps(_mm256_set1_ps(pass.rowKernel[ky] * bSpline[kx]), expNegative8(exponent)));
+            const __m256 varianceQ = _mm256_loadu_ps(pass.variance + q);
+            const __m256 tapVariance = _mm256_blendv_ps(varianceQ, variance, _mm256_cmp_ps(varianceQ, zero, _CMP_LT_OQ));
+            sumR = _mm256_add_ps(sumR, _mm256_mul_ps(weight, _mm256_loadu_ps(pass.r + q)));
+            sumG = _mm256_add_ps(sumG, _mm256_mul_ps(weight, _mm256_loadu_ps(pass.g + q)));
+            sumB = _mm256_add_ps(sumB, _mm256_mul_ps(weight, _mm256_loadu_ps(pass.b + q)));
+            sumVariance = _mm256_add_ps(sumVariance, _mm256_mul_ps(_mm256_mul_ps(weight, weight), tapVariance));
+            sumWeight = _mm256_add_ps(sumWeight, weight);
+        }
+    }
+
+    // the sky and the pixels without weight keep their value
+    const __m256 keep = _mm256_or_ps(sky, _mm256_cmp_ps(sumWeight, zero, _CMP_LE_OQ));
+    const __m256 inverseWeight = _mm256_div_ps(one, sumWeight);
+    const __m256 r = _mm256_blendv_ps(_mm256_mul_ps(sumR, inverseWeight), _mm256_loadu_ps(pass.r + p), keep);
+    const __m256 g = _mm256_blendv_ps(_mm256_mul_ps(sumG, inverseWeight), _mm256_loadu_ps(pass.g + p), keep);
+    const __m256 b = _mm256_blendv_ps(_mm256_mul_ps(sumB, inverseWeight), _mm256_loadu_ps(pass.b + p), keep);
+    if (pass.frame) {
+        alignas(32) float outR[8], outG[8], outB[8];
+        _mm256_store_ps(outR, r);
+        _mm256_store_ps(outG, g);
+        _mm256_store_ps(outB, b);
+        for (int lane = 0; lane < 8; ++lane) {
+            writeOutput(pass, x + lane, outR[lane], outG[lane], outB[lane]);
+        }
+        return;
+    }
+    const __m256 luminance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.2126f)), _mm256_mul_ps(g, _mm256_set1_ps(0.7152f))),
+        _mm256_mul_ps(b, _mm256_set1_ps(0.0722f)));
+    _mm256_storeu_ps(pass.outR + p, r);
+    _mm256_storeu_ps(pass.outG + p, g);
+    _mm256_storeu_ps(pass.outB + p, b);
+    _mm256_storeu_ps(pass.outVariance + p, _mm256_blendv_ps(_mm256_mul_ps(sumVariance, _mm256_mul_ps(inverseWeight, inverseWeight)), variance, keep));
+    _mm256_storeu_ps(pass.outLuminance + p, luminance);
+}
+#endif
+
+#if SIMD_SSE
+static inline __m128 expNegative4(__m128 x) {
+    const __m128 t = _mm_min_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _mm_set1_ps(100.0f));
+    const __m128i i = _mm_cvttps_epi32(t);
+    const __m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(i));
+    __m128 p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.00961813f), f), _mm_set1_ps(-0.05550411f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.24022651f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(-0.69314718f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+    return _mm_mul_ps(p, _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(127), i), 23)));
+}
+
+// mask ? b : a, sse2 has no blend
+static inline __m128 select4(__m128 a, __m128 b, __m128 mask) {
+    return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a));
+}
+
+// centerVariance() for the 4 pixels from x, the spatial estimate only runs when one of them needs it
+static inline __m128 centerVariance4(const RowPass &pass, int x) {
+    const __m128 variance = _mm_loadu_ps(pass.variance + pass.row + x);
+    const __m128 few = _mm_cmplt_ps(variance, _mm_setzero_ps());
+    if (_mm_movemask_ps(few) == 0) {
+        return variance;
+    }
+    __m128 covered = _mm_setzero_ps(), sum = _mm_setzero_ps(), sumSquares = _mm_setzero_ps();
+    for (int qy = std::max(pass.y - 3, 0); qy <= std::min(pass.y + 3, pass.height - 1); ++qy) {
+        const int q = qy * pass.width + x;
+        covered = _mm_add_ps(covered, _mm_loadu_ps(pass.rowCovered + q));
+        sum = _mm_add_ps(sum, _mm_loadu_ps(pass.rowLuminance + q));
+        sumSquares = _mm_add_ps(sumSquares, _mm_loadu_ps(pass.rowLuminanceSquares + q));
+    }
+    const __m128 inverseCovered = _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(covered, _mm_set1_ps(1.0f)));
+    const __m128 mean = _mm_mul_ps(sum, inverseCovered);
+    const __m128 spatial = _mm_max_ps(_mm_sub_ps(_mm_mul_ps(sumSquares, inverseCovered), _mm_mul_ps(mean, mean)), _mm_setzero_ps());
+    return select4(variance, spatial, few);
+}
+
+// filterPixel() for the 4 pixels from x, all of their taps must be inside the row
+static void filterPixels4(const RowPass &pass, int x) {
+    const int p = pass.row + x;
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 depthP = _mm_loadu_ps(pass.depth + p), luminanceP = _mm_loadu_ps(pass.luminance + p);
+    const __m128 normalXP = _mm_loadu_ps(pass.normalX + p), normalYP = _mm_loadu_ps(pass.normalY + p), normalZP = _mm_loadu_ps(pass.normalZ + p);
+    const __m128 variance = centerVariance4(pass, x);
+    const __m128 luminanceScale = _mm_div_ps(one,
+        _mm_add_ps(_mm_mul_ps(_mm_set1_ps(pass.colorPhi), _mm_sqrt_ps(variance)), _mm_set1_ps(1e-4f)));
+    const __m128 sky = _mm_cmple_ps(depthP, zero);
+    const __m128 depthScale = _mm_andnot_ps(sky, _mm_div_ps(one, _mm_mul_ps(depthP, _mm_set1_ps(pass.depthPhi))));
+    const __m128 normalPower = _mm_set1_ps(pass.normalPower);
+    const __m128 center = _mm_and_ps(_mm_cmpgt_ps(depthP, zero), _mm_set1_ps(centerKernel));
+    __m128 sumR = _mm_mul_ps(center, _mm_loadu_ps(pass.r + p)), sumG = _mm_mul_ps(center, _mm_loadu_ps(pass.g + p)), sumB = _mm_mul_ps(center, _mm_loadu_ps(pass.b + p));
+    __m128 sumVariance = _mm_mul_ps(_mm_mul_ps(center, center), variance), sumWeight = center;
+    for (int ky = 0; ky < 3; ++ky) {
+        for (int kx = 0; kx < 3; ++kx) {
+            if (kx == 1 && ky == 1) {
+                continue;
+            }
+            const int q = pass.tapRows[ky] + x + (kx - 1) * pass.step;
+            const __m128 depthQ = _mm_loadu_ps(pass.depth + q);
+            const __m128 cosine = _mm_add_ps(_mm_add_ps(_mm_mul_ps(normalXP, _mm_loadu_ps(pass.normalX + q)), _mm_mul_ps(normalYP, _mm_loadu_ps(pass.normalY + q))),
+                _mm_mul_ps(normalZP, _mm_loadu_ps(pass.normalZ + q)));
+            __m128 exponent = _mm_mul_ps(_mm_and_ps(absMask, _mm_sub_ps(luminanceP, _mm_loadu_ps(pass.luminance + q))), luminanceScale);
+            exponent = _mm_add_ps(exponent, _mm_mul_ps(_mm_and_ps(absMask, _mm_sub_ps(depthP, depthQ)), depthScale));
+            exponent = _mm_max_ps(_mm_add_ps(exponent, _mm_mul_ps(normalPower, _mm_sub_ps(one, cosine))), zero);
+            const __m128 covered = _mm_cmpgt_ps(depthQ, zero);
+            const __m128 weight = _mm_and_ps(covered, _mm_mul_ps(_mm_set1_ps(pass.rowKernel[ky] * bSpline[kx]), expNegative4(exponent)));
+            const __m128 varianceQ = _mm_loadu_ps(pass.variance + q);
+            const __m128 tapVariance = select4(varianceQ, variance, _mm_cmplt_ps(varianceQ, zero));
+            sumR = _mm_add_ps(sumR, _mm_mul_ps(weight, _mm_loadu_ps(pass.r + q)));
+            sumG = _mm_add_ps(sumG, _mm_mul_ps(weight, _mm_loadu_ps(pass.g + q)));
+            sumB = _mm_add_ps(sumB, _mm_mul_ps(weight, _mm_loadu_ps(pass.b + q)));
+            sumVariance = _mm_add_ps(sumVariance, _mm_mul_ps(_mm_mul_ps(weight, weight), tapVariance));
+            sumWeight = _mm_add_ps(sumWeight, weight);
+        }
+    }
+
+    // the sky and the pixels without weight keep their value
+    const __m128 keep = _mm_or_ps(sky, _mm_cmple_ps(sumWeight, zero));
+    const __m128 inverseWeight = _mm_div_ps(one, sumWeight);
+    const __m128 r = select4(_mm_mul_ps(sumR, inverseWeight), _mm_loadu_ps(pass.r + p), keep);
+    const __m128 g = select4(_mm_mul_ps(sumG, inverseWeight), _mm_loadu_ps(pass.g + p), keep);
+    const __m128 b = select4(_mm_mul_ps(sumB, inverseWeight), _mm_loadu_ps(pass.b + p), keep);
+    if (pass.frame) {
+        alignas(16) float outR[4], outG[4], outB[4];
+        _mm_store_ps(outR, r);
+        _mm_store_ps(outG, g);
+        _mm_store_ps(outB, b);
+        for (int lane = 0; lane < 4; ++lane) {
+            writeOutput(pass, x + lane, outR[lane], outG[lane], outB[lane]);
+        }
+        return;
+    }
+    const __m128 luminance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126f)), _mm_mul_ps(g, _mm_set1_ps(0.7152f))), _mm_mul_ps(b, _mm_set1_ps(0.0722f)));
+    _mm_storeu_ps(pass.outR + p, r);
+    _mm_storeu_ps(pass.outG + p, g);
+    _mm_storeu_ps(pass.outB + p, b);
+    _mm_storeu_ps(pass.outVariance + p, select4(_mm_mul_ps(sumVariance, _mm_mul_ps(inverseWeight, inverseWeight)), variance, keep));
+    _mm_storeu_ps(pass.outLuminance + p, luminance);
+}
+#endif
+
+void Denoiser::Planes::resize(size_t size) {
+    r.resize(size);
+    g.resize(size);
+    b.resize(size);
+    variance.resize(size);
+    luminance.resize(size);
+}
+
+void Denoiser::denoise(ThreadPool &threadPool, uint32_t width, uint32_t height, const glm::vec4 *accumulation, const float *luminanceSquares,
+    const uint32_t *sampleCounts, const Guides &guides, const Settings &settings, uint32_t *output) {
+    const int halfWidth = (int)(width + 1) / 2, halfHeight = (int)(height + 1) / 2;
+    const uint32_t halfCount = (uint32_t)(halfWidth * halfHeight);
+    planes[0].resize(halfCount);
+    planes[1].resize(halfCount);
+    normalX.resize(halfCount);
+    normalY.resize(halfCount);
+    normalZ.resize(halfCount);
+    depth.resize(halfCount);
+    rowCovered.resize(halfCount);
+    rowLuminance.resize(halfCount);
+    rowLuminanceSquares.resize(halfCount);
+    surfaceMasks.resize(halfCount);
+    const Frame frame = {accumulation, sampleCounts, &guides, output, (int)width, (int)height, 4.0f * settings.depthPhi};
+
+    // average the illumination of the pixels of each 2x2 block on the surface of its first pixel which is not sky, with the albedo
+    // divided out. The variance is that of the mean of the samples, -1 when a pixel has too few of them to tell
+    threadPool.parallelFor((uint32_t)halfHeight, [&](uint32_t y, uint32_t) {
+        Planes &in = planes[0];
+        const int row = (int)y * halfWidth;
+        for (int x = 0; x < halfWidth; ++x) {
+            const int p = row + x;
+            // pixel sy * 2 + sx of the block, -1 outside the image
+            int block[4];
+            for (int k = 0; k < 4; ++k) {
+                const int fx = x * 2 + (k & 1), fy = (int)y * 2 + (k >> 1);
+                block[k] = fx < (int)width && fy < (int)height ? fy * (int)width + fx : -1;
+            }
+            const int *first = std::find_if(block, block + 4, [&](int i) { return i >= 0 && guides.depth[i] > 0.0f; });
+            surfaceMasks[p] = 0;
+            if (first == block + 4) {
+                // the sky is never filtered, the output keeps its own pixels
+                in.r[p] = in.g[p] = in.b[p] = in.variance[p] = in.luminance[p] = 0.0f;
+                normalX[p] = normalY[p] = normalZ[p] = depth[p] = 0.0f;
+                continue;
+            }
+            const glm::vec3 &surfaceNormal = guides.normal[*first];
+            const float surfaceDepth = guides.depth[*first];
+            glm::vec3 illumination(0.0f);
+            float variance = 0.0f;
+            uint32_t fewestSamples = varianceSamples;
+            int matches = 0;
+            for (int k = 0; k < 4; ++k) {
+                const int i = block[k];
+                if (i < 0 || !sameSurface(guides.depth[i], guides.normal[i], surfaceDepth, surfaceNormal, frame.depthTolerance)) {
+                    continue;
+                }
+                float inverseCount = 1.0f / (float)std::max(sampleCounts[i], 1u);
+                glm::vec3 mean = glm::vec3(accumulation[i]) * inverseCount;
+                float luminance = Utils::luminance(mean);
+                glm::vec3 albedo = glm::max(guides.albedo[i], glm::vec3(0.001f));
+                float albedoLuminance = Utils::luminance(albedo);
+                illumination += mean / albedo;
+                variance += std::max(0.0f, luminanceSquares[i] * inverseCount - luminance * luminance) * inverseCount / (albedoLuminance * albedoLuminance);
+                fewestSamples = std::min(fewestSamples, sampleCounts[i]);
+                surfaceMasks[p] |= (uint8_t)(1 << k);
+                ++matches;
+            }
+            illumination /= (float)matches;
+            in.r[p] = illumination.r;
+            in.g[p] = illumination.g;
+            in.b[p] = illumination.b;
+            in.variance[p] = fewestSamples < varianceSamples ? -1.0f : variance / (float)(matches * matches);
+            in.luminance[p] = Utils::luminance(illumination);
+            normalX[p] = surfaceNormal.x;
+            normalY[p] = surfaceNormal.y;
+            normalZ[p] = surfaceNormal.z;
+            depth[p] = surfaceDepth;
+        }
+
+        // the moments of the luminance over the covered pixels of each 7 in the row, for the spatial variance. The sky has a
+        // luminance of 0 here, so only its count needs leaving out
+        for (int x = 0; x < halfWidth; ++x) {
+            float covered = 0.0f, sum = 0.0f, sumSquares = 0.0f;
+            for (int qx = std::max(x - 3, 0); qx <= std::min(x + 3, halfWidth - 1); ++qx) {
+                const int q = row + qx;
+                covered += depth[q] > 0.0f ? 1.0f : 0.0f;
+                sum += in.luminance[q];
+                sumSquares += in.luminance[q] * in.luminance[q];
+            }
+            rowCovered[row + x] = covered;
+            rowLuminance[row + x] = sum;
+            rowLuminanceSquares[row + x] = sumSquares;
+        }
+    });
+
+    // the last iteration writes the output itself, the pixels of its blocks are found there
+    const int iterations = std::max(settings.iterations, 1);
+    int source = 0;
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        const int step = 1 << iteration;
+        const Planes &in = planes[source];
+        Planes &out = planes[1 - source];
+        threadPool.parallelFor((uint32_t)halfHeight, [&](uint32_t y, uint32_t) {
+            const int w = halfWidth;
+            RowPass pass = {in.r.data(), in.g.data(), in.b.data(), in.variance.data(), in.luminance.data(),
+                normalX.data(), normalY.data(), normalZ.data(), depth.data(), surfaceMasks.data(),
+                out.r.data(), out.g.data(), out.b.data(), out.variance.data(), out.luminance.data(),
+                rowCovered.data(), rowLuminance.data(), rowLuminanceSquares.data(), iteration + 1 == iterations ? &frame : nullptr,
+                w, halfHeight, (int)y, (int)y * w, step, {}, {}, settings.colorPhi, settings.depthPhi * 2.0f * step, (float)settings.normalPower};
+            for (int ky = 0; ky < 3; ++ky) {
+                const int qy = (int)y + (ky - 1) * step;
+                const bool inside = qy >= 0 && qy < halfHeight;
+                pass.tapRows[ky] = (inside ? qy : (int)y) * w;
+                pass.rowKernel[ky] = inside ? bSpline[ky] : 0.0f;
+            }
+            // every tap of the pixels in [step, width - step) is inside the row, only the borders need the checks
+            const int interiorBegin = std::min(step, w), interiorEnd = std::max(w - step, interiorBegin);
+            int x = 0;
+            for (; x < interiorBegin; ++x) {
+                filterPixel(pass, x);
+            }
+#if SIMD_AVX2
+            for (; x + 8 <= interiorEnd; x += 8) {
+                filterPixels8(pass, x);
+            }
+#endif
+#if SIMD_SSE
+            for (; x + 4 <= interiorEnd; x += 4) {
+                filterPixels4(pass, x);
+            }
+#endif
+            for (; x < w; ++x) {
+                filterPixel(pass, x);
+            }
+        });
+        source = 1 - source;
+    }
+}
\ No newline at end of file
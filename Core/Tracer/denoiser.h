@@ -0,0 +1,56 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+
+#include "threadpool.h"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the variance guided luminance weight of svgf
+// (Schied et al. 2017). The illumination is filtered with the albedo divided out, so the textures stay sharp, and at half
+// resolution, each 2x2 block of pixels on one surface shares a filtered value.
+class Denoiser {
+public:
+    // per pixel, written at the first hit. A depth of 0 is a pixel which sees the sky
+    struct Guides {
+        const glm::vec3 *albedo;
+        const glm::vec3 *normal;
+        const float *depth;
+    };
+
+    struct Settings {
+        // the kernel is 3x3 half resolution pixels and doubles its step every iteration, 4 iterations cover 62x62 pixels
+        int iterations = 4;
+        // how many standard deviations apart two luminances may be and still blend, higher is blurrier
+        float colorPhi = 4.0f;
+        // the normal weight is about the cosine between two normals to this power
+        int normalPower = 128;
+        // relative depth difference per pixel of step, pixels within 4 times it of each other share a half resolution pixel
+        float depthPhi = 0.01f;
+    };
+
+private:
+    // one plane per channel, so that the loops over a row vectorize
+    struct Planes {
+        std::vector<float> r, g, b;
+        // variance of the luminance
+        std::vector<float> variance;
+        std::vector<float> luminance;
+
+        void resize(size_t size);
+    };
+    // ping pong between the iterations, at half resolution like the guides
+    Planes planes[2];
+    std::vector<float> normalX, normalY, normalZ, depth;
+    // bit sy * 2 + sx is set for the pixels of the 2x2 block on its surface
+    std::vector<uint8_t> surfaceMasks;
+    // sums of the luminance moments over the 7 pixels around each one in its row, the spatial variance of the pixels with few
+    // samples adds up 7 rows of them
+    std::vector<float> rowCovered, rowLuminance, rowLuminanceSquares;
+
+public:
+    // filter the mean of the accumulated samples into output
+    void denoise(ThreadPool &threadPool, uint32_t width, uint32_t height, const glm::vec4 *accumulation, const float *luminanceSquares,
+        const uint32_t *sampleCounts, const Guides &guides, const Settings &settings, uint32_t *output);
+};
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include "sampler.h"
+#include "random.h"
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+static constexpr uint32_t blueNoiseSize = 64;
+
+static uint32_t hash(uint32_t x) {
+    // lowbias32
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hashCombine(uint32_t seed, uint32_t v) {
+    return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+static uint32_t reverseBits(uint32_t v) {
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+    v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+// owen scrambling as a hash, Burley 2020 "Practical Hash-based Owen Scrambling"
+static uint32_t nestedUniformScramble(uint32_t v, uint32_t seed) {
+    v = reverseBits(v);
+    v += seed;
+    v ^= v * 0x6c50b47cu;
+    v ^= v * 0xb82f1e52u;
+    v ^= v * 0xc7afe638u;
+    v ^= v * 0x8d22f6e6u;
+    return reverseBits(v);
+}
+
+// the second sobol dimension, its generator matrix is the pascal matrix
+static uint32_t sobol1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+static float toFloat(uint32_t v) {
+    return (float)(v >> 8) * (1.0f / 16777216.0f);
+}
+
+// void and cluster (Ulichney 1993) on a torus, ranks of the texels in [0, 1)
+static std::vector<float> makeBlueNoise() {
+    const uint32_t n = blueNoiseSize, count = n * n;
+    const float sigma = 1.5f;
+    // the gaussian between two texels only depends on their wrapped offset
+    std::vector<float> kernel(count);
+    for (uint32_t dy = 0; dy < n; ++dy) {
+        for (uint32_t dx = 0; dx < n; ++dx) {
+            float wx = (float)std::min(dx, n - dx), wy = (float)std::min(dy, n - dy);
+            kernel[dx + dy * n] = std::exp(-(wx * wx + wy * wy) / (2.0f * sigma * sigma));
+        }
+    }
+
+    std::vector<uint8_t> pattern(count, 0);
+    std::vector<float> energy(count, 0.0f);
+    auto set = [&](uint32_t p, bool on) {
+        pattern[p] = on;
+        float sign = on ? 1.0f : -1.0f;
+        uint32_t px = p % n, py = p / n;
+        for (uint32_t q = 0; q < count; ++q) {
+            energy[q] += sign * kernel[((q % n - px) & (n - 1)) + ((q / n - py) & (n - 1)) * n];
+        }
+    };
+    auto tightestCluster = [&]() {
+        uint32_t best = 0;
+        float bestEnergy = -1.0f;
+        for (uint32_t p = 0; p < count; ++p) {
+            if (pattern[p] && energy[p] > bestEnergy) {
+                best = p;
+                bestEnergy = energy[p];
+            }
+        }
+        return best;
+    };
+    auto largestVoid = [&]() {
+        uint32_t best = 0;
+        float bestEnergy = std::numeric_limits<float>::max();
+        for (uint32_t p = 0; p < count; ++p) {
+            if (!pattern[p] && energy[p] < bestEnergy) {
+                best = p;
+                bestEnergy = energy[p];
+            }
+        }
+        return best;
+    };
+
+    // a tenth of the texels at random, then move the tightest cluster into the largest void until it stays
+    const uint32_t initialCount = count / 10;
+    PCG rng(1);
+    for (uint32_t placed = 0; placed < initialCount;) {
+        uint32_t p = rng.UInt() % count;
+        if (!pattern[p]) {
+            set(p, true);
+            ++placed;
+        }
+    }
+    while (true) {
+        uint32_t cluster = tightestCluster();
+        set(cluster, false);
+        uint32_t gap = largestVoid();
+        set(gap, true);
+        if (gap == cluster) {
+            break;
+        }
+    }
+
+    std::vector<uint32_t> rank(count);
+    std::vector<uint8_t> initialPattern = pattern;
+    std::vector<float> initialEnergy = energy;
+    for (uint32_t r = initialCount; r-- > 0;) {
+        uint32_t cluster = tightestCluster();
+        set(cluster, false);
+        rank[cluster] = r;
+    }
+    pattern = initialPattern;
+    energy = initialEnergy;
+    // the tightest cluster of the zeros is the largest void of the ones for this energy, so one loop fills the other half too
+    for (uint32_t r = initialCount; r < count; ++r) {
+        uint32_t gap = largestVoid();
+        set(gap, true);
+        rank[gap] = r;
+    }
+
+    std::vector<float> texture(count);
+    for (uint32_t p = 0; p < count; ++p) {
+        texture[p] = ((float)rank[p] + 0.5f) / (float)count;
+    }
+    return texture;
+}
+
+static const std::vector<float> &blueNoise() {
+    // made on first use, takes a few milliseconds
+    static const std::vector<float> texture = makeBlueNoise();
+    return texture;
+}
+
+Sampler::Sampler(SamplerType type, uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t seed)
+    : type(type), x(x), y(y), sampleIndex(sampleIndex), seed(hash(seed)), pixelSeed(hashCombine(hash(x | (y << 16)), this->seed)) {
+}
+
+glm::vec2 Sampler::get2D(uint32_t dimension) const {
+    switch (type) {
+    case SamplerType::Sobol: {
+        uint32_t dimensionSeed = hashCombine(pixelSeed, hash(dimension));
+        uint32_t index = nestedUniformScramble(sampleIndex, dimensionSeed);
+        return glm::vec2(toFloat(nestedUniformScramble(reverseBits(index), hashCombine(dimensionSeed, 0))),
+            toFloat(nestedUniformScramble(sobol1(index), hashCombine(dimensionSeed, 1))));
+    }
+    case SamplerType::BlueNoise: {
+        // the same texel offsets for every pixel, so neighbouring pixels keep the blue noise between them
+        const auto &texture = blueNoise();
+        const uint32_t mask = blueNoiseSize - 1;
+        uint32_t offsets = hash(hashCombine(seed, hash(dimension)));
+        float noiseX = texture[((x + offsets) & mask) + ((y + (offsets >> 6)) & mask) * blueNoiseSize];
+        float noiseY = texture[((x + (offsets >> 12)) & mask) + ((y + (offsets >> 18)) & mask) * blueNoiseSize];
+        // r2 in fixed point, so that it stays exact for any sample count
+        uint32_t r2X = sampleIndex * 3242174889u, r2Y = sampleIndex * 2447445414u;
+        return glm::vec2(toFloat(r2X + (uint32_t)(noiseX * 4294967296.0)), toFloat(r2Y + (uint32_t)(noiseY * 4294967296.0)));
+    }
+    case SamplerType::Random:
+    default: {
+        PCG rng(PCG::seed(pixelSeed, sampleIndex, dimension));
+        float u = rng.Float();
+        return glm::vec2(u, rng.Float());
+    }
+    }
+}
+
+const char *Sampler::name(SamplerType type) {
+    switch (type) {
+    case SamplerType::Random: return "random";
+    case SamplerType::Sobol: return "sobol";
+    case SamplerType::BlueNoise: return "blue noise";
+    }
+    return "unknown";
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+
+enum class SamplerType {
+    // independent pcg numbers
+    Random,
+    // owen scrambled sobol, shuffled per pixel and dimension
+    Sobol,
+    // the r2 sequence rotated by a blue noise texture, the error is spread as blue noise over the pixels
+    BlueNoise
+};
+
+// The random numbers of one sample of one pixel. Every dimension is its own 2D sequence over the samples of the pixel, so a path
+// takes a new dimension for every decision it makes and the same decision of the next sample continues its sequence.
+class Sampler {
+private:
+    SamplerType type;
+    uint32_t x, y;
+    uint32_t sampleIndex;
+    uint32_t seed;
+    uint32_t pixelSeed;
+
+public:
+    // a different seed gives sequences unrelated to those of the default one
+    Sampler(SamplerType type, uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t seed = 0);
+
+    // [0, 1)^2
+    glm::vec2 get2D(uint32_t dimension) const;
+    float get1D(uint32_t dimension) const { return get2D(dimension).x; }
+
+    static const char *name(SamplerType type);
+};
\ No newline at end of file
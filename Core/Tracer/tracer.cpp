@@ -1,9 +1,15 @@
 #include "tracer.h"
 #include "random.h"
 #include "utils.hpp"
+#include "timer.h"
+
+#include <glm/gtc/constants.hpp>
 
-#include <execution>
 #include <array>
+#include <numeric>
+#include <algorithm>
+#include <execution>
+#include <atomic>
 
 void Tracer::resize(uint32_t width, uint32_t height) {
     if (!image) {
@@ -21,12 +27,119 @@ void Tracer::resize(uint32_t width, uint32_t height) {
 
     delete[] accumulationData;
     accumulationData = new glm::vec4[width * height];
+
+    delete[] luminanceSquares;
+    luminanceSquares = new float[width * height];
+
+    delete[] sampleCounts;
+    sampleCounts = new uint32_t[width * height];
+
+    delete[] albedoData;
+    albedoData = new glm::vec3[width * height];
+
+    delete[] normalData;
+    normalData = new glm::vec3[width * height];
+
+    delete[] positionData;
+    positionData = new glm::vec3[width * height];
+
+    delete[] depthData;
+    depthData = new float[width * height];
+
+    delete[] reprojectedAccumulation;
+    reprojectedAccumulation = new glm::vec4[width * height];
+
+    delete[] reprojectedLuminanceSquares;
+    reprojectedLuminanceSquares = new float[width * height];
+
+    delete[] reprojectedSampleCounts;
+    reprojectedSampleCounts = new uint32_t[width * height];
+
+    delete[] reprojectedNormals;
+    reprojectedNormals = new glm::vec3[width * height];
+
+    delete[] reprojectedPositions;
+    reprojectedPositions = new glm::vec3[width * height];
+
+    primaryHits.resize(width * height);
     resetFrame();
+}
+
+static uint32_t interleaveBits(uint32_t v) {
+    v &= 0x0000FFFFu;
+    v = (v | (v << 8)) & 0x00FF00FFu;
+    v = (v | (v << 4)) & 0x0F0F0F0Fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+// the sampler dimensions of one bounce, bounce i takes i * DimensionsPerBounce + these
+enum BounceDimension : uint32_t {
+    DirectionDimension,
+    RouletteDimension,
+    LightPickDimension,
+    LightPointDimension,
+    DimensionsPerBounce
+};
 
-    imageHorizontalIter.resize(width);
-    imageVerticalIter.resize(height);
-    std::iota(imageHorizontalIter.begin(), imageHorizontalIter.end(), 0);
-    std::iota(imageVerticalIter.begin(), imageVerticalIter.end(), 0);
+// weight of a sample from the strategy with pdf against the one with otherPdf
+static float powerHeuristic(float pdf, float otherPdf) {
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+// cosine distributed around the normal by malley's method, the concentric disk keeps the strata of the sample
+static glm::vec3 cosineHemisphere(const glm::vec3 &normal, const glm::vec2 &u) {
+    glm::vec2 a = 2.0f * u - 1.0f;
+    glm::vec2 disk(0.0f);
+    if (a.x != 0.0f || a.y != 0.0f) {
+        float r, phi;
+        if (std::abs(a.x) > std::abs(a.y)) {
+            r = a.x;
+            phi = glm::pi<float>() * 0.25f * (a.y / a.x);
+        }
+        else {
+            r = a.y;
+            phi = glm::pi<float>() * 0.5f - glm::pi<float>() * 0.25f * (a.x / a.y);
+        }
+        disk = glm::vec2(r * std::cos(phi), r * std::sin(phi));
+    }
+    float z = std::sqrt(std::max(0.0f, 1.0f - glm::dot(disk, disk)));
+
+    // orthonormal basis without a singular normal, Duff et al. 2017
+    float sign = std::copysign(1.0f, normal.z);
+    float c = -1.0f / (sign + normal.z);
+    float d = normal.x * normal.y * c;
+    glm::vec3 t(1.0f + sign * normal.x * normal.x * c, sign * d, -sign * normal.x);
+    glm::vec3 b(d, sign + normal.y * normal.y * c, -normal.y);
+    return glm::normalize(t * disk.x + b * disk.y + normal * z);
+}
+
+void Tracer::updateTiles() {
+    uint32_t size = std::max(packetWidth, settings.tileSize / packetWidth * packetWidth);
+    uint32_t width = image->getWidth(), height = image->getHeight();
+    uint32_t columns = (width + size - 1) / size, rows = (height + size - 1) / size;
+    if (size == tileSize && width == tiledWidth && height == tiledHeight) {
+        return;
+    }
+    tileSize = size;
+    tiledWidth = width;
+    tiledHeight = height;
+    tileErrors.clear();
+
+    std::vector<std::pair<uint32_t, Tile>> ordered;
+    for (uint32_t ty = 0; ty < rows; ++ty) {
+        for (uint32_t tx = 0; tx < columns; ++tx) {
+            Tile tile{tx * size, ty * size, std::min(size, width - tx * size), std::min(size, height - ty * size)};
+            ordered.emplace_back(interleaveBits(tx) | (interleaveBits(ty) << 1), tile);
+        }
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    tiles.clear();
+    for (const auto &entry : ordered) {
+        tiles.push_back(entry.second);
+    }
+    tileErrors.resize(tiles.size(), std::numeric_limits<float>::max());
 }
 
 void Tracer::render(const Scene &scene, const Camera &camera) {
@@ -34,39 +147,120 @@ void Tracer::render(const Scene &scene, const Camera &camera) {
 
     activeCamera = &camera;
     activeScene = &scene;
+    updateInstances();
+    updateLights();
 
-    if (frameIndex == 1) {
+    updateTiles();
+    if (cameraMoved) {
+        cameraMoved = false;
+        // nothing to keep before the second frame
+        if (settings.reprojection && settings.accumulate && frameIndex > 1) {
+            reproject();
+        }
+        else {
+            resetFrame();
+        }
+    }
+    viewProjection = camera.getProjection() * camera.getView();
+    // the preview passes trace a part of the pixels, so they neither fill the cache nor need it
+    const bool preview = previewing && settings.progressive;
+    readPrimaryHits = settings.cachePrimaryHits && primaryHitsValid && !preview;
+    writePrimaryHits = settings.cachePrimaryHits && !primaryHitsValid && !preview;
+    stats.primaryHitsCached = readPrimaryHits;
+    // the preview passes add to the first frame
+    if (frameIndex == 1 && previewPass == 0) {
         memset(accumulationData, 0, width * height * sizeof(glm::vec4));
+        memset(luminanceSquares, 0, width * height * sizeof(float));
+        memset(sampleCounts, 0, width * height * sizeof(uint32_t));
+        std::fill(tileErrors.begin(), tileErrors.end(), std::numeric_limits<float>::max());
     }
+    stats.tileTimings.resize(tiles.size());
+
+    // without accumulation every frame starts over, so there is nothing to skip
+    const bool adaptive = settings.adaptiveSampling && settings.accumulate;
+    stats.convergedTiles = 0;
+    if (adaptive) {
+        stats.convergedTiles = (uint32_t)std::count_if(tileErrors.begin(), tileErrors.end(), [this](float error) {
+            return error < settings.errorThreshold;
+        });
+    }
+    stats.converged = adaptive && stats.convergedTiles == tiles.size();
+    if (stats.converged && settings.stopWhenConverged) {
+        // the image already shows the converged result
+        return;
+    }
+    uint32_t threadCount = settings.threadCount > 0 ? settings.threadCount : ThreadPool::hardwareThreads();
+    if (threadPool.threadCount() != threadCount) {
+        threadPool.resize(threadCount);
+    }
+
+    Timer timer;
+    stats.previewScale = 1;
+    if (preview) {
+        stats.threadCount = threadCount;
+        stats.wavefrontBounces.clear();
+        renderPreviewPass();
+    }
+    else if (settings.integrator == Integrator::Wavefront) {
+        stats.threadCount = threadCount;
+        renderWavefront(adaptive);
+    }
+    else {
+        stats.wavefrontBounces.clear();
+        std::atomic<uint64_t> pathCount{0};
+        auto renderTileAt = [this, adaptive, &pathCount](uint32_t i, uint32_t threadIndex) {
+            Timer timer;
+            uint32_t rayCount = 0;
+            if (!adaptive || tileErrors[i] >= settings.errorThreshold) {
+                rayCount = renderTile(tiles[i]);
+                pathCount += tiles[i].width * tiles[i].height;
+                if (adaptive) {
+                    tileErrors[i] = tileError(tiles[i]);
+                }
+            }
+            stats.tileTimings[i] = {tiles[i].x, tiles[i].y, threadIndex, rayCount, timer.elapsedMs()};
+        };
 #define MULTI_THREAD true
 #if MULTI_THREAD
-    std::for_each(std::execution::par, imageVerticalIter.begin(), imageVerticalIter.end(), 
-        [this, width](uint32_t y) {
-            std::for_each(std::execution::par, imageHorizontalIter.begin(), imageHorizontalIter.end(), 
-                [this, y, width](uint32_t x) {
-                    glm::vec4 color = perPixel(x, y);
-                    accumulationData[x + y * width] += color;
-                    glm::vec4 accumulatedColor = accumulationData[x + y * width] / (float)frameIndex;
-                    accumulatedColor = glm::clamp(accumulatedColor, glm::vec4(0.0f), glm::vec4(1.0f));
-
-                    imageData[x + y * width] = Utils::glmVec4ToUint32t(accumulatedColor);
-                }
-            );
-        }    
-    );
+        stats.threadCount = threadCount;
+        // each tile is written by one thread only, which keeps the threads off each other's cache lines
+        threadPool.parallelFor((uint32_t)tiles.size(), renderTileAt);
 #else
-    for (uint32_t y = 0; y < height; ++y) {
-        for (uint32_t x = 0; x < width; ++x) {
-            glm::vec4 color = perPixel(x, y);
-            accumulationData[x + y * width] += color;
-            glm::vec4 accumulatedColor = accumulationData[x + y * width] / (float)frameIndex;
-            accumulatedColor = glm::clamp(accumulatedColor, glm::vec4(0.0f), glm::vec4(1.0f));
-
-            imageData[x + y * width] = Utils::glmVec4ToUint32t(accumulatedColor);
+        stats.threadCount = 1;
+        for (uint32_t i = 0; i < tiles.size(); ++i) {
+            renderTileAt(i, 0);
         }
-    }
 #endif
 #undef MULTI_THREAD
+        stats.rayCount = 0;
+        for (uint32_t i = 0; i < tiles.size(); ++i) {
+            stats.rayCount += stats.tileTimings[i].rayCount;
+        }
+        stats.pathCount = pathCount;
+    }
+    stats.traceTimeMs = timer.elapsedMs();
+    if (writePrimaryHits) {
+        // adaptive sampling may have skipped some tiles
+        primaryHitsValid = stats.pathCount == (uint64_t)width * height;
+    }
+
+    if (preview && ++previewPass < previewPassCount) {
+        // not every pixel has a sample yet, so there is nothing to denoise
+        stats.denoiseTimeMs = 0.0f;
+        image->setData(imageData);
+        return;
+    }
+    previewing = false;
+    previewPass = 0;
+
+    stats.denoiseTimeMs = 0.0f;
+    if (settings.denoise) {
+        timer.reset();
+        // every pixel has taken a sample before the first frame gets here, so all guides are written
+        denoiser.denoise(threadPool, width, height, accumulationData, luminanceSquares, sampleCounts, {albedoData, normalData, depthData},
+            settings.denoiser, imageData);
+        stats.denoiseTimeMs = timer.elapsedMs();
+    }
 
     image->setData(imageData);
 
@@ -78,6 +272,75 @@ void Tracer::render(const Scene &scene, const Camera &camera) {
     }
 }
 
+void Tracer::updateInstances() {
+    // Only the top level depends on scale/translate, the bvh of every model stays in object space.
+    bool countChanged = instances.size() != activeScene->models.size();
+    bool moved = false;
+    instances.resize(activeScene->models.size());
+    std::vector<AABB> instanceBounds(instances.size());
+    for (size_t i = 0; i < instances.size(); ++i) {
+        const auto &model = activeScene->models[i];
+        auto &instance = instances[i];
+        AABB bounds;
+        if (!model.bvh.empty()) {
+            // modelTransform is scale * translate
+            const AABB &objectBounds = model.bvh.nodes[0].bounds;
+            bounds.grow((objectBounds.min + model.translate) * model.scale);
+            bounds.grow((objectBounds.max + model.translate) * model.scale);
+        }
+        instanceBounds[i] = bounds;
+        if (!countChanged && instance.scale == model.scale && instance.translate == model.translate
+            && instance.bounds.min == bounds.min && instance.bounds.max == bounds.max) {
+            continue;
+        }
+        moved = true;
+        instance.scale = model.scale;
+        instance.translate = model.translate;
+        instance.inverseScale = 1.0f / model.scale;
+        instance.bounds = bounds;
+    }
+    if (moved) {
+        primaryHitsValid = false;
+    }
+
+    if (countChanged) {
+        // the topology no longer matches, a pending rebuild is useless too
+        if (pendingTLAS.valid()) {
+            pendingTLAS.wait();
+            pendingTLAS = {};
+        }
+        tlas.build(instanceBounds);
+        stats.tlas = tlas.stats;
+        stats.tlasSahCost = tlas.stats.sahCost;
+        stats.tlasRebuildPending = false;
+        ++stats.tlasBuildCount;
+        return;
+    }
+
+    if (pendingTLAS.valid() && pendingTLAS.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        // it was built from older bounds, the refit below catches up with the current ones
+        tlas = pendingTLAS.get();
+        stats.tlas = tlas.stats;
+        stats.tlasRebuildPending = false;
+        ++stats.tlasBuildCount;
+        moved = true;
+    }
+    if (!moved) {
+        return;
+    }
+
+    stats.tlasSahCost = tlas.refit(instanceBounds);
+    ++stats.tlasRefitCount;
+    if (!pendingTLAS.valid() && stats.tlasSahCost > stats.tlas.sahCost * settings.tlasRebuildThreshold) {
+        pendingTLAS = std::async(std::launch::async, [instanceBounds]() {
+            BVH bvh;
+            bvh.build(instanceBounds);
+            return bvh;
+        });
+        stats.tlasRebuildPending = true;
+    }
+}
+
 glm::vec3 Tracer::shade(Tracer::HitPayload &hitPayload) {
     const Material &mat = activeScene->models[hitPayload.modelIndex].meshes[hitPayload.meshIndex].mat;
     glm::vec3 kd = mat.kd;
@@ -101,28 +364,564 @@ glm::vec3 Tracer::shade(Tracer::HitPayload &hitPayload) {
     return kd;
 }
 
-glm::vec4 Tracer::perPixel(uint32_t x, uint32_t y) {
-    Ray ray;
-    ray.origin = activeCamera->getPosition();
-    ray.direction = activeCamera->getRayDirections()[x + y * image->getWidth()];
+std::vector<Tracer::EmissiveTriangle> Tracer::findEmitters(const Model &model) {
+    std::vector<EmissiveTriangle> emitters;
+    for (const auto &mesh : model.meshes) {
+        glm::vec3 emission = mesh.mat.getEmission();
+        if (Utils::luminance(emission) <= 0.0f) {
+            continue;
+        }
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+            const glm::vec3 &p0 = mesh.vertices[mesh.indices[i]].position;
+            glm::vec3 edge1 = mesh.vertices[mesh.indices[i + 1]].position - p0;
+            glm::vec3 edge2 = mesh.vertices[mesh.indices[i + 2]].position - p0;
+            // the normal and the area are only known in world space
+            emitters.push_back({p0, edge1, edge2, glm::vec3(0.0f), emission});
+        }
+    }
+    return emitters;
+}
+
+void Tracer::updateLights() {
+    const auto &models = activeScene->models;
+    bool changed = models.size() != litModels.size();
+    for (size_t i = 0; i < models.size() && !changed; ++i) {
+        changed = litModels[i].id != models[i].id || litModels[i].scale != models[i].scale || litModels[i].translate != models[i].translate;
+    }
+    if (!changed) {
+        return;
+    }
+    Timer timer;
+
+    // only the models which are new are searched, the removed ones are forgotten
+    std::unordered_map<uint64_t, std::vector<EmissiveTriangle>> emitters;
+    litModels.clear();
+    for (const auto &model : models) {
+        litModels.push_back({model.id, model.scale, model.translate});
+        if (emitters.count(model.id)) {
+            continue;
+        }
+        auto found = modelEmitters.find(model.id);
+        emitters[model.id] = found != modelEmitters.end() ? std::move(found->second) : findEmitters(model);
+    }
+    modelEmitters = std::move(emitters);
+
+    // the world space triangles and the table are cheap next to searching the meshes, so they are made again as a whole
+    emissiveTriangles.clear();
+    std::vector<float> powers;
+    for (const auto &model : models) {
+        for (const auto &emitter : modelEmitters[model.id]) {
+            // modelTransform is scale * translate
+            glm::vec3 p0 = (emitter.p0 + model.translate) * model.scale;
+            glm::vec3 edge1 = emitter.edge1 * model.scale, edge2 = emitter.edge2 * model.scale;
+            glm::vec3 normal = glm::cross(edge1, edge2);
+            float area = 0.5f * glm::length(normal);
+            if (area <= 0.0f) {
+                continue;
+            }
+            emissiveTriangles.push_back({p0, edge1, edge2, normal / (2.0f * area), emitter.emission});
+            powers.push_back(Utils::luminance(emitter.emission) * area);
+        }
+    }
+    emissiveTable.build(powers);
+    stats.emissiveTriangleCount = (uint32_t)emissiveTriangles.size();
+    stats.lightBuildTimeMs = timer.elapsedMs();
+    ++stats.lightBuildCount;
+}
+
+float Tracer::emissionPdf(const HitPayload &hitPayload, const Ray &ray, const glm::vec3 &emission) const {
+    if (emissiveTable.empty()) {
+        return 0.0f;
+    }
+    // picking the triangle by power times a uniform point on it, the area cancels out. The cosine is against the same normal as in
+    // sampleLights, with the interpolated one the two weights would not add up to one on smooth emitters
+    float cosine = std::abs(glm::dot(hitPayload.geometricNormal, ray.direction));
+    if (cosine <= 0.0f) {
+        return 0.0f;
+    }
+    return Utils::luminance(emission) / emissiveTable.sum() * hitPayload.hitDistance * hitPayload.hitDistance / cosine;
+}
+
+glm::vec3 Tracer::sampleLights(const HitPayload &hitPayload, const glm::vec3 &kd, const Sampler &sampler, int bounce, uint32_t &rayCount) const {
+    const glm::vec3 &normal = hitPayload.worldNormal;
+    const glm::vec3 origin = hitPayload.worldPosition + normal * 0.0001f;
+    glm::vec3 light(0.0f);
+
+    // the direction lights light the surface as in the rasterizer, kd * intensity * cos, nothing else can find them
+    for (const auto &directionLight : activeScene->lights) {
+        glm::vec3 toLight = glm::normalize(-directionLight.direction);
+        float cosine = glm::dot(normal, toLight);
+        if (cosine <= 0.0f) {
+            continue;
+        }
+        ++rayCount;
+        if (!occluded(Ray{origin, toLight}, std::numeric_limits<float>::max())) {
+            light += kd * directionLight.intensity * cosine;
+        }
+    }
+
+    if (emissiveTable.empty()) {
+        return light;
+    }
+    // one emissive triangle by its power and a uniform point on it
+    const uint32_t dimension = bounce * DimensionsPerBounce;
+    glm::vec2 pick = sampler.get2D(dimension + LightPickDimension);
+    const EmissiveTriangle &triangle = emissiveTriangles[emissiveTable.sample(pick.x, pick.y)];
+    glm::vec2 u = sampler.get2D(dimension + LightPointDimension);
+    if (u.x + u.y > 1.0f) {
+        u = 1.0f - u;
+    }
+    glm::vec3 toLight = triangle.p0 + triangle.edge1 * u.x + triangle.edge2 * u.y - origin;
+    float distanceSquared = glm::dot(toLight, toLight);
+    float distance = std::sqrt(distanceSquared);
+    toLight /= distance;
+    float cosine = glm::dot(normal, toLight);
+    float lightCosine = std::abs(glm::dot(triangle.normal, toLight));
+    if (cosine <= 0.0f || lightCosine <= 0.0f) {
+        return light;
+    }
+    ++rayCount;
+    // stop short of the light, or the shadow ray hits it
+    if (occluded(Ray{origin, toLight}, distance * 0.999f)) {
+        return light;
+    }
+    float lightPdf = Utils::luminance(triangle.emission) / emissiveTable.sum() * distanceSquared / lightCosine;
+    float scatterPdf = cosine / glm::pi<float>();
+    // no ray leaves the last bounce, so the light sample is the only strategy there and takes the whole weight
+    float weight = bounce + 1 == settings.bounceTimes ? 1.0f : powerHeuristic(lightPdf, scatterPdf);
+    light += kd / glm::pi<float>() * triangle.emission * cosine * weight / lightPdf;
+    return light;
+}
+
+bool Tracer::scatter(HitPayload &hitPayload, const Sampler &sampler, int bounce, PathState &path, uint32_t &rayCount) {
+    const auto &mat = activeScene->models[hitPayload.modelIndex].meshes[hitPayload.meshIndex].mat;
+    glm::vec3 emission = mat.getEmission();
+    if (emission != glm::vec3(0.0f)) {
+        // the light sample of the last hit could have found this light too, the two weights add up to one
+        float weight = 1.0f;
+        if (settings.lightSampling && path.scatterPdf > 0.0f) {
+            weight = powerHeuristic(path.scatterPdf, emissionPdf(hitPayload, path.ray, emission));
+        }
+        path.light += emission * path.contribution * weight;
+    }
+    glm::vec3 kd = shade(hitPayload);
+    if (bounce == 0) {
+        writeGuides(path.pixel, kd, &hitPayload);
+    }
+    if (settings.lightSampling) {
+        path.light += path.contribution * sampleLights(hitPayload, kd, sampler, bounce, rayCount);
+    }
+    // lambertian, the cosine and the pi of the brdf cancel against the pdf of the cosine distributed direction
+    path.contribution *= kd;
+
+    if (settings.russianRoulette && bounce >= settings.rouletteDepth) {
+        // paths which can only add little light stop, the survivors carry the light of those that stopped
+        const glm::vec3 &contribution = path.contribution;
+        float survival = std::min(std::max(contribution.x, std::max(contribution.y, contribution.z)), 0.95f);
+        if (sampler.get1D(bounce * DimensionsPerBounce + RouletteDimension) >= survival) {
+            return false;
+        }
+        path.contribution /= survival;
+    }
+
+    path.ray.origin = hitPayload.worldPosition + hitPayload.worldNormal * 0.0001f;
+    path.ray.direction = cosineHemisphere(hitPayload.worldNormal, sampler.get2D(bounce * DimensionsPerBounce + DirectionDimension));
+    path.scatterPdf = std::max(glm::dot(path.ray.direction, hitPayload.worldNormal), 0.0f) / glm::pi<float>();
+    return true;
+}
+
+uint32_t Tracer::renderTile(const Tile &tile) {
+    uint32_t rayCount = 0;
+    uint32_t width = image->getWidth();
+    if (readPrimaryHits) {
+        for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+            for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+                writePixel(x, y, perPixel(x, y, rayCount, &primaryHits[x + y * width]));
+            }
+        }
+        return rayCount;
+    }
+    if (settings.packetTracing) {
+        for (uint32_t y = tile.y; y < tile.y + tile.height; y += packetWidth) {
+            for (uint32_t x = tile.x; x < tile.x + tile.width; x += packetWidth) {
+                uint32_t pixelIndices[RayPacket::maxSize];
+                RayPacket packet = primaryPacket(x, y, pixelIndices);
+                HitPayload hitPayloads[RayPacket::maxSize];
+                tracePacket(packet, hitPayloads);
+                rayCount += packet.size;
+                for (uint32_t i = 0; i < packet.size; ++i) {
+                    uint32_t px = pixelIndices[i] % width, py = pixelIndices[i] / width;
+                    writePixel(px, py, perPixel(px, py, rayCount, &hitPayloads[i]));
+                }
+            }
+        }
+        return rayCount;
+    }
+    for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+        for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+            writePixel(x, y, perPixel(x, y, rayCount));
+        }
+    }
+    return rayCount;
+}
+
+// the preview pass which traces pixel (x, y)
+static uint32_t previewPassOf(uint32_t x, uint32_t y) {
+    if ((x & 3) == 0 && (y & 3) == 0) {
+        return 0;
+    }
+    if ((x & 1) == 0 && (y & 1) == 0) {
+        return 1;
+    }
+    return 2;
+}
+
+void Tracer::renderPreviewPass() {
+    uint32_t width = image->getWidth();
+    const uint32_t pass = previewPass;
+    std::atomic<uint64_t> pathCount{0};
+    threadPool.parallelFor((uint32_t)tiles.size(), [this, width, pass, &pathCount](uint32_t i, uint32_t threadIndex) {
+        Timer timer;
+        const Tile &tile = tiles[i];
+        uint32_t rayCount = 0, paths = 0;
+        for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+            for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+                if (previewPassOf(x, y) == pass) {
+                    writePixel(x, y, perPixel(x, y, rayCount));
+                    ++paths;
+                }
+            }
+        }
+        if (pass + 1 < previewPassCount) {
+            // the tiles are a multiple of 8 pixels, so each block and the pixel in its corner are in the same tile
+            const uint32_t mask = pass == 0 ? ~3u : ~1u;
+            for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+                for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+                    imageData[x + y * width] = imageData[(x & mask) + (y & mask) * width];
+                }
+            }
+        }
+        pathCount += paths;
+        stats.tileTimings[i] = {tile.x, tile.y, threadIndex, rayCount, timer.elapsedMs()};
+    });
+    stats.rayCount = 0;
+    for (const auto &timing : stats.tileTimings) {
+        stats.rayCount += timing.rayCount;
+    }
+    stats.pathCount = pathCount;
+    stats.previewScale = pass == 0 ? 16 : pass == 1 ? 4 : 1;
+}
+
+void Tracer::renderWavefront(bool adaptive) {
+    uint32_t width = image->getWidth();
+    const auto &rayDirections = activeCamera->getRayDirections();
+    stats.wavefrontBounces.clear();
+    stats.rayCount = 0;
 
-    glm::vec3 light = glm::vec3(0, 0, 0);
-    glm::vec3 contribution = glm::vec3(1.0f);
+    // one path for every pixel of the tiles which still take samples
+    paths.clear();
+    stats.pathCount = 0;
+    for (uint32_t i = 0; i < tiles.size(); ++i) {
+        const Tile &tile = tiles[i];
+        stats.tileTimings[i] = {tile.x, tile.y, 0, 0, 0.0f};
+        if (adaptive && tileErrors[i] < settings.errorThreshold) {
+            continue;
+        }
+        for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+            for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+                PathState path;
+                path.ray.origin = activeCamera->getPosition();
+                path.ray.direction = rayDirections[x + y * width];
+                path.light = glm::vec3(0.0f);
+                path.contribution = glm::vec3(1.0f);
+                path.pixel = x + y * width;
+                path.scatterPdf = 0.0f;
+                paths.emplace_back(path);
+            }
+        }
+    }
+
+    stats.pathCount = paths.size();
+    auto chunksOf = [](size_t count) {
+        return (uint32_t)((count + wavefrontChunkSize - 1) / wavefrontChunkSize);
+    };
+    for (int bounce = 0; bounce < settings.bounceTimes && !paths.empty(); ++bounce) {
+        const uint32_t pathCount = (uint32_t)paths.size();
+        const uint32_t chunkCount = chunksOf(pathCount);
+        WavefrontBounce bounceStats;
+        const bool cached = bounce == 0 && readPrimaryHits;
+        bounceStats.rayCount = cached ? 0 : pathCount;
+        stats.rayCount += bounceStats.rayCount;
+
+        // trace the whole stream
+        Timer timer;
+        hits.resize(pathCount);
+        const bool write = bounce == 0 && writePrimaryHits;
+        threadPool.parallelFor(chunkCount, [this, pathCount, cached, write](uint32_t chunk, uint32_t) {
+            for (uint32_t i = chunk * wavefrontChunkSize; i < std::min(pathCount, (chunk + 1) * wavefrontChunkSize); ++i) {
+                if (cached) {
+                    hits[i] = primaryHits[paths[i].pixel];
+                    continue;
+                }
+                hits[i] = traceRay(paths[i].ray);
+                if (write) {
+                    primaryHits[paths[i].pixel] = hits[i];
+                }
+            }
+        });
+        bounceStats.traceTimeMs = timer.elapsedMs();
+
+        // shade in material order, so that the same textures are read one after another
+        timer.reset();
+        shadeOrder.resize(pathCount);
+        std::iota(shadeOrder.begin(), shadeOrder.end(), 0);
+        if (settings.sortByMaterial) {
+            auto materialKey = [this](uint32_t i) {
+                // the misses go last
+                return hits[i].modelIndex < 0 ? std::numeric_limits<uint64_t>::max() : ((uint64_t)hits[i].modelIndex << 32) | (uint32_t)hits[i].meshIndex;
+            };
+            std::sort(std::execution::par, shadeOrder.begin(), shadeOrder.end(), [&materialKey](uint32_t a, uint32_t b) {
+                return materialKey(a) < materialKey(b);
+            });
+        }
+        bounceStats.sortTimeMs = timer.elapsedMs();
+
+        timer.reset();
+        pathAlive.resize(pathCount);
+        chunkAliveCounts.resize(chunkCount);
+        const bool lastBounce = bounce + 1 == settings.bounceTimes;
+        std::atomic<uint32_t> shadowRayCount{0};
+        threadPool.parallelFor(chunkCount, [this, pathCount, width, bounce, lastBounce, &shadowRayCount](uint32_t chunk, uint32_t) {
+            uint32_t aliveCount = 0, shadowRays = 0;
+            for (uint32_t k = chunk * wavefrontChunkSize; k < std::min(pathCount, (chunk + 1) * wavefrontChunkSize); ++k) {
+                PathState &path = paths[shadeOrder[k]];
+                HitPayload &hitPayload = hits[shadeOrder[k]];
+                bool alive = false;
+                if (hitPayload.modelIndex < 0) {
+                    path.light += activeScene->skyColor * path.contribution;
+                    if (bounce == 0) {
+                        writeGuides(path.pixel, glm::vec3(1.0f), nullptr);
+                    }
+                }
+                else {
+                    Sampler sampler(settings.sampler, path.pixel % width, path.pixel / width, sampleCounts[path.pixel], samplerSeed);
+                    alive = scatter(hitPayload, sampler, bounce, path, shadowRays) && !lastBounce;
+                }
+                if (!alive) {
+                    // every pixel has one path, so no other thread writes it
+                    writePixel(path.pixel % width, path.pixel / width, glm::vec4(path.light, 1.0f));
+                }
+                pathAlive[k] = alive;
+                aliveCount += alive;
+            }
+            chunkAliveCounts[chunk] = aliveCount;
+            shadowRayCount += shadowRays;
+        });
+        bounceStats.shadeTimeMs = timer.elapsedMs();
+        // traced while shading, not as a stream of their own
+        bounceStats.shadowRayCount = shadowRayCount;
+        stats.rayCount += shadowRayCount;
+
+        // compact the terminated paths out, each chunk writes its survivors after those of the chunks before it
+        timer.reset();
+        uint32_t aliveCount = 0;
+        for (auto &count : chunkAliveCounts) {
+            uint32_t chunkAlive = count;
+            count = aliveCount;
+            aliveCount += chunkAlive;
+        }
+        nextPaths.resize(aliveCount);
+        threadPool.parallelFor(chunkCount, [this, pathCount](uint32_t chunk, uint32_t) {
+            uint32_t next = chunkAliveCounts[chunk];
+            for (uint32_t k = chunk * wavefrontChunkSize; k < std::min(pathCount, (chunk + 1) * wavefrontChunkSize); ++k) {
+                if (pathAlive[k]) {
+                    nextPaths[next++] = paths[shadeOrder[k]];
+                }
+            }
+        });
+        std::swap(paths, nextPaths);
+        bounceStats.compactTimeMs = timer.elapsedMs();
+        stats.wavefrontBounces.emplace_back(bounceStats);
+    }
+
+    if (adaptive) {
+        threadPool.parallelFor((uint32_t)tiles.size(), [this](uint32_t i, uint32_t) {
+            if (tileErrors[i] >= settings.errorThreshold) {
+                tileErrors[i] = tileError(tiles[i]);
+            }
+        });
+    }
+}
+
+float Tracer::tileError(const Tile &tile) const {
+    uint32_t width = image->getWidth();
+    float maxError = 0.0f;
+    for (uint32_t y = tile.y; y < tile.y + tile.height; ++y) {
+        for (uint32_t x = tile.x; x < tile.x + tile.width; ++x) {
+            uint32_t i = x + y * width;
+            float n = (float)sampleCounts[i];
+            if (sampleCounts[i] < std::max(settings.minSamples, 2u)) {
+                return std::numeric_limits<float>::max();
+            }
+            float mean = Utils::luminance(glm::vec3(accumulationData[i])) / n;
+            float variance = std::max(0.0f, luminanceSquares[i] / n - mean * mean) * n / (n - 1.0f);
+            // standard error of the mean relative to the mean, the floor lets almost black pixels converge on an absolute error
+            maxError = std::max(maxError, std::sqrt(variance / n) / std::max(mean, 0.01f));
+        }
+    }
+    return maxError;
+}
+
+void Tracer::writePixel(uint32_t x, uint32_t y, const glm::vec4 &color) {
+    uint32_t width = image->getWidth();
+    uint32_t i = x + y * width;
+    accumulationData[i] += color;
+    float luminance = Utils::luminance(glm::vec3(color));
+    luminanceSquares[i] += luminance * luminance;
+    ++sampleCounts[i];
+    glm::vec4 accumulatedColor = accumulationData[i] / (float)sampleCounts[i];
+    accumulatedColor = glm::clamp(accumulatedColor, glm::vec4(0.0f), glm::vec4(1.0f));
+
+    imageData[i] = Utils::glmVec4ToUint32t(accumulatedColor);
+}
+
+void Tracer::writeGuides(uint32_t pixel, const glm::vec3 &albedo, const HitPayload *hitPayload) {
+    albedoData[pixel] = albedo;
+    normalData[pixel] = hitPayload ? hitPayload->worldNormal : glm::vec3(0.0f);
+    positionData[pixel] = hitPayload ? hitPayload->worldPosition : glm::vec3(0.0f);
+    depthData[pixel] = hitPayload ? hitPayload->hitDistance : 0.0f;
+}
+
+void Tracer::reproject() {
+    Timer timer;
+    uint32_t width = image->getWidth(), height = image->getHeight();
+    const glm::vec3 origin = activeCamera->getPosition();
+    const auto &rayDirections = activeCamera->getRayDirections();
+    std::atomic<uint32_t> reprojectedPixels{0};
+    threadPool.parallelFor(height, [this, width, height, &origin, &rayDirections, &reprojectedPixels](uint32_t y, uint32_t) {
+        uint32_t reprojected = 0;
+        for (uint32_t x = 0; x < width; ++x) {
+            uint32_t i = x + y * width;
+            HitPayload hitPayload = traceRay(Ray{origin, rayDirections[i]});
+            if (settings.cachePrimaryHits) {
+                primaryHits[i] = hitPayload;
+            }
+            const bool sky = hitPayload.modelIndex < 0;
+            glm::vec3 albedo(1.0f);
+            if (!sky) {
+                albedo = shade(hitPayload);
+            }
+            // the other threads still read the normals and positions of the old view, the rest of the guides is only read for pixel i
+            albedoData[i] = albedo;
+            depthData[i] = sky ? 0.0f : hitPayload.hitDistance;
+            reprojectedNormals[i] = sky ? glm::vec3(0.0f) : hitPayload.worldNormal;
+            reprojectedPositions[i] = sky ? glm::vec3(0.0f) : hitPayload.worldPosition;
+
+            // the sky is a direction, it is projected as a point at infinity
+            glm::vec4 clip = viewProjection * (sky ? glm::vec4(rayDirections[i], 0.0f) : glm::vec4(hitPayload.worldPosition, 1.0f));
+            bool valid = false;
+            uint32_t previous = 0;
+            if (clip.w > 0.0f) {
+                // the inverse of the pixel to ndc mapping of the camera rays
+                float px = std::floor((clip.x / clip.w + 1.0f) * 0.5f * width + 0.5f);
+                float py = std::floor((clip.y / clip.w + 1.0f) * 0.5f * height + 0.5f);
+                if (px >= 0.0f && px < (float)width && py >= 0.0f && py < (float)height) {
+                    previous = (uint32_t)px + (uint32_t)py * width;
+                    const glm::vec3 &previousNormal = normalData[previous];
+                    const bool previousSky = previousNormal == glm::vec3(0.0f);
+                    if (sky) {
+                        valid = previousSky;
+                    }
+                    else {
+                        // disoccluded when the pixel saw another surface before
+                        valid = !previousSky && glm::dot(previousNormal, hitPayload.worldNormal) > 0.9f &&
+                            glm::length(positionData[previous] - hitPayload.worldPosition) < settings.reprojectionTolerance * hitPayload.hitDistance;
+                    }
+                }
+            }
+
+            if (valid && sampleCounts[previous] > 0) {
+                // the surfaces are lambertian, so the light they reflect does not depend on where they are seen from
+                uint32_t count = sampleCounts[previous];
+                float keep = count > settings.maxReprojectedSamples ? (float)settings.maxReprojectedSamples / count : 1.0f;
+                reprojectedAccumulation[i] = accumulationData[previous] * keep;
+                reprojectedLuminanceSquares[i] = luminanceSquares[previous] * keep;
+                reprojectedSampleCounts[i] = std::min(count, settings.maxReprojectedSamples);
+                ++reprojected;
+            }
+            else {
+                reprojectedAccumulation[i] = glm::vec4(0.0f);
+                reprojectedLuminanceSquares[i] = 0.0f;
+                reprojectedSampleCounts[i] = 0;
+            }
+        }
+        reprojectedPixels += reprojected;
+    });
+    std::swap(accumulationData, reprojectedAccumulation);
+    std::swap(luminanceSquares, reprojectedLuminanceSquares);
+    std::swap(sampleCounts, reprojectedSampleCounts);
+    std::swap(normalData, reprojectedNormals);
+    std::swap(positionData, reprojectedPositions);
+    // every pixel was traced for the new view
+    primaryHitsValid = settings.cachePrimaryHits;
+    // the sample counts changed, every tile has to prove its error again
+    std::fill(tileErrors.begin(), tileErrors.end(), std::numeric_limits<float>::max());
+
+    stats.reprojectedPixels = reprojectedPixels;
+    stats.reprojectionTimeMs = timer.elapsedMs();
+}
+
+RayPacket Tracer::primaryPacket(uint32_t x, uint32_t y, uint32_t *pixelIndices) const {
+    uint32_t width = image->getWidth(), height = image->getHeight();
+    const auto &rayDirections = activeCamera->getRayDirections();
+    RayPacket packet;
+    packet.origin = activeCamera->getPosition();
+    for (uint32_t py = y; py < std::min(y + packetWidth, height); ++py) {
+        for (uint32_t px = x; px < std::min(x + packetWidth, width); ++px) {
+            pixelIndices[packet.size] = px + py * width;
+            packet.directions[packet.size++] = rayDirections[px + py * width];
+        }
+    }
+    packet.finalize();
+    return packet;
+}
+
+glm::vec4 Tracer::perPixel(uint32_t x, uint32_t y, uint32_t &rayCount, const HitPayload *primaryHit) {
+    PathState path;
+    path.ray.origin = activeCamera->getPosition();
+    path.ray.direction = activeCamera->getRayDirections()[x + y * image->getWidth()];
+    path.light = glm::vec3(0.0f);
+    path.contribution = glm::vec3(1.0f);
+    path.pixel = x + y * image->getWidth();
+    path.scatterPdf = 0.0f;
+
+    // the pixel has taken sampleCounts samples before this one
+    Sampler sampler(settings.sampler, x, y, sampleCounts[path.pixel], samplerSeed);
     for (int i = 0; i < settings.bounceTimes; ++i) {
-        HitPayload hitPayload = traceRay(ray);
+        HitPayload hitPayload;
+        if (i == 0 && primaryHit) {
+            hitPayload = *primaryHit;
+        }
+        else {
+            hitPayload = traceRay(path.ray);
+            ++rayCount;
+        }
+        if (i == 0 && writePrimaryHits) {
+            // before scatter shades it
+            primaryHits[path.pixel] = hitPayload;
+        }
         if (hitPayload.modelIndex < 0) {
-            light += activeScene->skyColor * contribution;
+            path.light += activeScene->skyColor * path.contribution;
+            if (i == 0) {
+                writeGuides(path.pixel, glm::vec3(1.0f), nullptr);
+            }
+            break;
+        }
+        if (!scatter(hitPayload, sampler, i, path, rayCount)) {
             break;
         }
-        
-        const auto &mat = activeScene->models[hitPayload.modelIndex].meshes[hitPayload.meshIndex].mat;
-        light += mat.getEmission() * contribution;
-        contribution *= shade(hitPayload);
-        
-        ray.origin = hitPayload.worldPosition + hitPayload.worldNormal * 0.0001f;
-        ray.direction = glm::normalize(Random::unitVec3() + hitPayload.worldNormal);
     }
-    return glm::vec4(light, 1.0f);
+    return glm::vec4(path.light, 1.0f);
 }
 
 static std::tuple<bool, float, float, float> rayIntersectionWithTriangle(const Ray &ray, std::array<Vertex, 3> &tri) {
@@ -158,51 +957,170 @@ Tracer::HitPayload Tracer::traceRay(const Ray &ray) {
     float hitDistance = std::numeric_limits<float>::max();
     int modelIndex = -1, meshIndex = -1;
     float alpha = 0, beta = 0;
-    int triVertexIndex[3] = {-1, -1, -1};
-    for (size_t i = 0; i < activeScene->models.size(); ++i) {
-        const auto &model = activeScene->models[i];
-        glm::mat4 modelTransform{1.0f};
-        modelTransform = glm::scale(modelTransform, model.scale);
-        modelTransform = glm::translate(modelTransform, model.translate);
-        for (size_t j = 0; j < model.meshes.size(); ++j) {
-            const auto &mesh = model.meshes[j];
-            for (size_t k = 0; k + 2 < mesh.indices.size(); k += 3) {
-                std::array<Vertex, 3> tri{mesh.vertices[mesh.indices[k]], mesh.vertices[mesh.indices[k + 1]], mesh.vertices[mesh.indices[k + 2]]};
-                for (auto &v : tri) {
-                    v.position = glm::vec3(modelTransform * glm::vec4(v.position, 1.0f));
-                }
-                auto [intersectRes, t, a, b] = rayIntersectionWithTriangle(ray, tri);
-                if (!intersectRes || t > hitDistance) {
-                    // no intersection or be covered
-                    continue;
-                }
-                hitDistance = t;
-                modelIndex = (int)i;
-                meshIndex = (int)j;
-                alpha = a;
-                beta = b;
-                triVertexIndex[0] = (int)k;
-                triVertexIndex[1] = (int)(k + 1);
-                triVertexIndex[2] = (int)(k + 2);
+    uint32_t firstIndex = 0;
+    tlas.traverse(ray, hitDistance, [&](uint32_t instanceIndex, float &closest) {
+        const auto &model = activeScene->models[instanceIndex];
+        const Instance &instance = instances[instanceIndex];
+        // The bvh of the model is built in object space, so move the ray instead of the triangles.
+        // modelTransform is scale * translate and the direction is not normalized again, so t is the same in world space.
+        Ray objectRay;
+        objectRay.origin = ray.origin * instance.inverseScale - instance.translate;
+        objectRay.direction = ray.direction * instance.inverseScale;
+        auto leafTest = [&](uint32_t first, uint32_t count, float &closestInModel) {
+            float u = 0, v = 0;
+            int hitIndex = model.triangleStore.intersect(objectRay, first, count, closestInModel, u, v, settings.triangleKernel);
+            if (hitIndex < 0) {
+                // no intersection or be covered
+                return;
             }
-
+            const TriangleRef &triRef = model.triangles[model.bvh.primIndices[hitIndex]];
+            modelIndex = (int)instanceIndex;
+            meshIndex = (int)triRef.meshIndex;
+            // u and v weight the second and the third vertex
+            alpha = 1.0f - u - v;
+            beta = u;
+            firstIndex = triRef.firstIndex;
+        };
+        // the wide bvhs keep the leaves of the binary one, so the triangle store and primIndices are shared
+        switch (settings.bvhWidth) {
+            case 4:
+                model.bvh4.traverseLeaves(objectRay, closest, leafTest);
+                break;
+            case 8:
+                model.bvh8.traverseLeaves(objectRay, closest, leafTest);
+                break;
+            default:
+                model.bvh.traverseLeaves(objectRay, closest, leafTest);
+                break;
         }
-    }
+    });
     if (modelIndex < 0 || meshIndex < 0) {
         return miss();
     }
     else {
         const auto &mesh = activeScene->models[modelIndex].meshes[meshIndex];
-        std::array<Vertex, 3> tri = {mesh.vertices[mesh.indices[triVertexIndex[0]]], mesh.vertices[mesh.indices[triVertexIndex[1]]], mesh.vertices[mesh.indices[triVertexIndex[2]]]};
+        std::array<Vertex, 3> tri = {mesh.vertices[mesh.indices[firstIndex]], mesh.vertices[mesh.indices[firstIndex + 1]], mesh.vertices[mesh.indices[firstIndex + 2]]};
         return closestHit(ray, hitDistance, modelIndex, meshIndex, tri, alpha, beta);
     }
 }
 
+bool Tracer::occluded(const Ray &ray, float tMax) const {
+    return tlas.traverseAny(ray, tMax, [&](uint32_t first, uint32_t count, float tMaxInTLAS) {
+        for (uint32_t i = first; i < first + count; ++i) {
+            uint32_t instanceIndex = tlas.primIndices[i];
+            const auto &model = activeScene->models[instanceIndex];
+            const Instance &instance = instances[instanceIndex];
+            // same transform as traceRay, t stays the same in object space
+            Ray objectRay;
+            objectRay.origin = ray.origin * instance.inverseScale - instance.translate;
+            objectRay.direction = ray.direction * instance.inverseScale;
+            auto leafTest = [&](uint32_t firstTriangle, uint32_t triangleCount, float tMaxInModel) {
+                return model.triangleStore.occluded(objectRay, firstTriangle, triangleCount, tMaxInModel, settings.triangleKernel);
+            };
+            bool hit;
+            switch (settings.bvhWidth) {
+                case 4:
+                    hit = model.bvh4.traverseAny(objectRay, tMaxInTLAS, leafTest);
+                    break;
+                case 8:
+                    hit = model.bvh8.traverseAny(objectRay, tMaxInTLAS, leafTest);
+                    break;
+                default:
+                    hit = model.bvh.traverseAny(objectRay, tMaxInTLAS, leafTest);
+                    break;
+            }
+            if (hit) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+void Tracer::tracePacket(const RayPacket &packet, HitPayload *hitPayloads) {
+    if (!packet.coherent) {
+        for (uint32_t i = 0; i < packet.size; ++i) {
+            hitPayloads[i] = traceRay(Ray{packet.origin, packet.directions[i]});
+        }
+        return;
+    }
+
+    float hitDistances[RayPacket::maxSize];
+    int modelIndices[RayPacket::maxSize], meshIndices[RayPacket::maxSize];
+    float alphas[RayPacket::maxSize], betas[RayPacket::maxSize];
+    uint32_t firstIndices[RayPacket::maxSize];
+    std::fill_n(hitDistances, packet.size, std::numeric_limits<float>::max());
+    std::fill_n(modelIndices, packet.size, -1);
+    tlas.traversePacket(packet, hitDistances, [&](uint32_t first, uint32_t count, uint64_t, float *closest) {
+        for (uint32_t i = first; i < first + count; ++i) {
+            uint32_t instanceIndex = tlas.primIndices[i];
+            const auto &model = activeScene->models[instanceIndex];
+            const Instance &instance = instances[instanceIndex];
+            // same as traceRay, the scale is positive so the directions keep their signs in object space
+            RayPacket objectPacket;
+            objectPacket.origin = packet.origin * instance.inverseScale - instance.translate;
+            objectPacket.size = packet.size;
+            for (uint32_t k = 0; k < packet.size; ++k) {
+                objectPacket.directions[k] = packet.directions[k] * instance.inverseScale;
+            }
+            objectPacket.finalize();
+
+            auto testRay = [&](uint32_t k, uint32_t firstTriangle, uint32_t triangleCount, float &closestInModel) {
+                float u = 0, v = 0;
+                int hitIndex = model.triangleStore.intersect(Ray{objectPacket.origin, objectPacket.directions[k]}, firstTriangle, triangleCount, closestInModel, u, v, settings.triangleKernel);
+                if (hitIndex < 0) {
+                    return;
+                }
+                const TriangleRef &triRef = model.triangles[model.bvh.primIndices[hitIndex]];
+                modelIndices[k] = (int)instanceIndex;
+                meshIndices[k] = (int)triRef.meshIndex;
+                alphas[k] = 1.0f - u - v;
+                betas[k] = u;
+                firstIndices[k] = triRef.firstIndex;
+            };
+            if (!objectPacket.coherent) {
+                for (uint32_t k = 0; k < packet.size; ++k) {
+                    Ray objectRay{objectPacket.origin, objectPacket.directions[k]};
+                    model.bvh.traverseLeaves(objectRay, closest[k], [&](uint32_t firstTriangle, uint32_t triangleCount, float &closestInModel) {
+                        testRay(k, firstTriangle, triangleCount, closestInModel);
+                    });
+                }
+                continue;
+            }
+            // the packet walks the binary bvh, its nodes are culled for all rays at once
+            model.bvh.traversePacket(objectPacket, closest, [&](uint32_t firstTriangle, uint32_t triangleCount, uint64_t rayMask, float *closestInModel) {
+                for (uint32_t k = 0; k < objectPacket.size; ++k) {
+                    if ((rayMask >> k) & 1) {
+                        testRay(k, firstTriangle, triangleCount, closestInModel[k]);
+                    }
+                }
+            });
+        }
+    });
+
+    for (uint32_t i = 0; i < packet.size; ++i) {
+        if (modelIndices[i] < 0) {
+            hitPayloads[i] = miss();
+            continue;
+        }
+        const auto &mesh = activeScene->models[modelIndices[i]].meshes[meshIndices[i]];
+        const uint32_t k = firstIndices[i];
+        std::array<Vertex, 3> tri = {mesh.vertices[mesh.indices[k]], mesh.vertices[mesh.indices[k + 1]], mesh.vertices[mesh.indices[k + 2]]};
+        hitPayloads[i] = closestHit(Ray{packet.origin, packet.directions[i]}, hitDistances[i], modelIndices[i], meshIndices[i], tri, alphas[i], betas[i]);
+    }
+}
+
 Tracer::HitPayload Tracer::closestHit(const Ray &ray, float hitDistance, int modelIndex, int meshIndex, std::array<Vertex, 3> &tri, float alpha, float beta) {
     HitPayload hitPayload;
     hitPayload.hitDistance = hitDistance;
     hitPayload.worldPosition = ray.origin + ray.direction * hitDistance;
-    hitPayload.worldNormal = Utils::lerp(alpha, beta, tri[0].position, tri[1].position, tri[2].position);
+    // the normals are in object space, a scale moves them by its inverse
+    hitPayload.worldNormal = glm::normalize(Utils::lerp(alpha, beta, tri[0].normal, tri[1].normal, tri[2].normal) * instances[modelIndex].inverseScale);
+    // the surfaces have two sides, shade the one the ray came from
+    if (glm::dot(hitPayload.worldNormal, ray.direction) > 0.0f) {
+        hitPayload.worldNormal = -hitPayload.worldNormal;
+    }
+    hitPayload.geometricNormal = glm::normalize(glm::cross(tri[1].position - tri[0].position, tri[2].position - tri[0].position) * instances[modelIndex].inverseScale);
     hitPayload.texcoords = Utils::lerp(alpha, beta, tri[0].texcoords, tri[1].texcoords, tri[2].texcoords);
     hitPayload.modelIndex = modelIndex;
     hitPayload.meshIndex = meshIndex;
@@ -220,4 +1138,244 @@ Tracer::HitPayload Tracer::miss() {
 
 void Tracer::resetFrame() {
     frameIndex = 1;
+    // the models may have been rebuilt
+    primaryHitsValid = false;
+    previewing = true;
+    previewPass = 0;
+}
+
+void Tracer::moveCamera() {
+    cameraMoved = true;
+    primaryHitsValid = false;
+}
+
+void Tracer::benchmarkBVH(const Scene &scene, const Camera &camera) {
+    stats.bvhBenchmark.clear();
+    const auto &rayDirections = camera.getRayDirections();
+    for (size_t i = 0; i < scene.models.size(); ++i) {
+        const auto &model = scene.models[i];
+        std::vector<AABB> triangleBounds = model.getTriangleBounds();
+        for (auto quality : {BVH::BuildQuality::Fast, BVH::BuildQuality::SAH}) {
+            BVH bvh;
+            bvh.build(triangleBounds, quality);
+            WideBVH<4> bvh4;
+            bvh4.collapse(bvh);
+            WideBVH<8> bvh8;
+            bvh8.collapse(bvh);
+
+            auto run = [&](uint32_t width, uint32_t nodeCount, float collapseTimeMs, const auto &tree) {
+                Ray objectRay;
+                objectRay.origin = camera.getPosition() / model.scale - model.translate;
+                uint64_t nodeVisits = 0, triangleTests = 0;
+                Timer timer;
+                for (const auto &direction : rayDirections) {
+                    objectRay.direction = direction / model.scale;
+                    float hitDistance = std::numeric_limits<float>::max();
+                    uint32_t rayNodeVisits = 0;
+                    tree.traverse(objectRay, hitDistance, [&](uint32_t triIndex, float &closest) {
+                        ++triangleTests;
+                        const TriangleRef &triRef = model.triangles[triIndex];
+                        const auto &mesh = model.meshes[triRef.meshIndex];
+                        const uint32_t k = triRef.firstIndex;
+                        std::array<Vertex, 3> tri{mesh.vertices[mesh.indices[k]], mesh.vertices[mesh.indices[k + 1]], mesh.vertices[mesh.indices[k + 2]]};
+                        auto [intersectRes, t, a, b] = rayIntersectionWithTriangle(objectRay, tri);
+                        if (intersectRes && t < closest) {
+                            closest = t;
+                        }
+                    }, &rayNodeVisits);
+                    nodeVisits += rayNodeVisits;
+                }
+
+                BVHBenchmarkResult result;
+                result.modelIndex = (int)i;
+                result.quality = quality;
+                result.bvh = bvh.stats;
+                result.width = width;
+                result.nodeCount = nodeCount;
+                result.collapseTimeMs = collapseTimeMs;
+                result.rayCount = (uint32_t)rayDirections.size();
+                result.traceTimeMs = timer.elapsedMs();
+                result.nodeVisitsPerRay = result.rayCount > 0 ? (float)nodeVisits / result.rayCount : 0.0f;
+                result.triangleTestsPerRay = result.rayCount > 0 ? (float)triangleTests / result.rayCount : 0.0f;
+                stats.bvhBenchmark.emplace_back(result);
+            };
+            run(2, (uint32_t)bvh.nodes.size(), 0.0f, bvh);
+            run(4, (uint32_t)bvh4.nodes.size(), bvh4.collapseTimeMs, bvh4);
+            run(8, (uint32_t)bvh8.nodes.size(), bvh8.collapseTimeMs, bvh8);
+        }
+    }
+}
+
+void Tracer::benchmarkTriangleKernels(const Scene &scene, const Camera &camera) {
+    stats.triangleKernelBenchmark.clear();
+    const auto &rayDirections = camera.getRayDirections();
+    uint64_t triangleCount = 0;
+    for (const auto &model : scene.models) {
+        triangleCount += model.triangleStore.size();
+    }
+    if (triangleCount == 0 || rayDirections.empty()) {
+        return;
+    }
+    // every ray is tested against every triangle, so keep the work around 20M tests
+    uint64_t rayCount = std::clamp<uint64_t>(20000000 / triangleCount, 1, rayDirections.size());
+    uint64_t rayStride = rayDirections.size() / rayCount;
+
+    auto run = [&](const char *name, auto &&testModel) {
+        TriangleKernelBenchmarkResult result;
+        result.name = name;
+        result.tests = rayCount * triangleCount;
+        result.hits = 0;
+        Timer timer;
+        for (uint64_t r = 0; r < rayCount; ++r) {
+            const glm::vec3 &direction = rayDirections[r * rayStride];
+            for (const auto &model : scene.models) {
+                Ray objectRay;
+                objectRay.origin = camera.getPosition() / model.scale - model.translate;
+                objectRay.direction = direction / model.scale;
+                float hitDistance = std::numeric_limits<float>::max();
+                if (testModel(model, objectRay, hitDistance)) {
+                    ++result.hits;
+                }
+            }
+        }
+        result.timeMs = timer.elapsedMs();
+        stats.triangleKernelBenchmark.emplace_back(result);
+    };
+
+    // the array of structures test that the tracer used before, as the baseline
+    run("aos determinant", [](const Model &model, const Ray &objectRay, float &hitDistance) {
+        bool hit = false;
+        for (const auto &triRef : model.triangles) {
+            const auto &mesh = model.meshes[triRef.meshIndex];
+            const uint32_t k = triRef.firstIndex;
+            std::array<Vertex, 3> tri{mesh.vertices[mesh.indices[k]], mesh.vertices[mesh.indices[k + 1]], mesh.vertices[mesh.indices[k + 2]]};
+            auto [intersectRes, t, a, b] = rayIntersectionWithTriangle(objectRay, tri);
+            if (intersectRes && t < hitDistance) {
+                hitDistance = t;
+                hit = true;
+            }
+        }
+        return hit;
+    });
+    for (auto kernel : {TriangleKernel::Scalar, TriangleKernel::SSE, TriangleKernel::AVX2}) {
+        if (!TriangleStore::isKernelSupported(kernel)) {
+            continue;
+        }
+        run(TriangleStore::kernelName(kernel), [kernel](const Model &model, const Ray &objectRay, float &hitDistance) {
+            float u, v;
+            return model.triangleStore.intersect(objectRay, 0, model.triangleStore.size(), hitDistance, u, v, kernel) >= 0;
+        });
+    }
+}
+
+void Tracer::benchmarkPrimaryRays(const Scene &scene, const Camera &camera) {
+    stats.primaryRayBenchmark.clear();
+    if (!image) {
+        return;
+    }
+    activeCamera = &camera;
+    activeScene = &scene;
+    updateInstances();
+    const uint32_t width = image->getWidth(), height = image->getHeight();
+    const auto &rayDirections = camera.getRayDirections();
+
+    PrimaryRayBenchmarkResult single{"single rays", width * height, 0, 0, 0.0f};
+    Timer timer;
+    for (uint32_t i = 0; i < width * height; ++i) {
+        if (traceRay(Ray{camera.getPosition(), rayDirections[i]}).modelIndex >= 0) {
+            ++single.hits;
+        }
+    }
+    single.timeMs = timer.elapsedMs();
+    stats.primaryRayBenchmark.emplace_back(single);
+
+    PrimaryRayBenchmarkResult packets{"packets", width * height, 0, 0, 0.0f};
+    timer.reset();
+    for (uint32_t y = 0; y < height; y += packetWidth) {
+        for (uint32_t x = 0; x < width; x += packetWidth) {
+            uint32_t pixelIndices[RayPacket::maxSize];
+            RayPacket packet = primaryPacket(x, y, pixelIndices);
+            HitPayload hitPayloads[RayPacket::maxSize];
+            tracePacket(packet, hitPayloads);
+            for (uint32_t i = 0; i < packet.size; ++i) {
+                if (hitPayloads[i].modelIndex >= 0) {
+                    ++packets.hits;
+                }
+            }
+            if (!packet.coherent) {
+                ++packets.incoherentPackets;
+            }
+        }
+    }
+    packets.timeMs = timer.elapsedMs();
+    stats.primaryRayBenchmark.emplace_back(packets);
+
+    PrimaryRayBenchmarkResult occlusion{"occlusion queries", width * height, 0, 0, 0.0f};
+    timer.reset();
+    for (uint32_t i = 0; i < width * height; ++i) {
+        if (occluded(Ray{camera.getPosition(), rayDirections[i]}, std::numeric_limits<float>::max())) {
+            ++occlusion.hits;
+        }
+    }
+    occlusion.timeMs = timer.elapsedMs();
+    stats.primaryRayBenchmark.emplace_back(occlusion);
 }
+
+void Tracer::benchmarkSamplers(const Scene &scene, const Camera &camera) {
+    stats.samplerBenchmark.clear();
+    if (!image) {
+        return;
+    }
+    const uint32_t pixelCount = image->getWidth() * image->getHeight();
+    const Settings savedSettings = settings;
+    settings.accumulate = true;
+    settings.adaptiveSampling = false;
+    // every render has to be a whole frame
+    settings.progressive = false;
+    // the error of what is shown, so that a few fireflies do not decide it
+    auto accumulatedLuminance = [this](uint32_t i) {
+        return Utils::luminance(glm::clamp(glm::vec3(accumulationData[i]) / (float)sampleCounts[i], glm::vec3(0.0f), glm::vec3(1.0f)));
+    };
+
+    // the reference takes other sequences, or the sampler which made it would be compared against its own first samples
+    settings.sampler = SamplerType::Sobol;
+    samplerSeed = 1;
+    resetFrame();
+    for (uint32_t i = 0; i < samplerReferenceSamples; ++i) {
+        render(scene, camera);
+    }
+    std::vector<float> reference(pixelCount);
+    double referenceSum = 0.0;
+    for (uint32_t i = 0; i < pixelCount; ++i) {
+        reference[i] = accumulatedLuminance(i);
+        referenceSum += reference[i];
+    }
+    const double referenceMean = std::max(referenceSum / pixelCount, 1e-6);
+    samplerSeed = 0;
+
+    for (auto type : {SamplerType::Random, SamplerType::Sobol, SamplerType::BlueNoise}) {
+        SamplerBenchmarkResult result{Sampler::name(type), samplerBenchmarkSamples, 0.0f, 0.0f, 0, 0.0f};
+        settings.sampler = type;
+        resetFrame();
+        for (uint32_t samples = 1; samples <= samplerBenchmarkSamples; ++samples) {
+            Timer timer;
+            render(scene, camera);
+            result.timeMs += timer.elapsedMs();
+
+            double squaredError = 0.0;
+            for (uint32_t i = 0; i < pixelCount; ++i) {
+                double difference = accumulatedLuminance(i) - reference[i];
+                squaredError += difference * difference;
+            }
+            result.error = (float)(std::sqrt(squaredError / pixelCount) / referenceMean);
+            if (result.targetSamples == 0 && result.error <= samplerTargetError) {
+                result.targetSamples = samples;
+                result.targetTimeMs = result.timeMs;
+            }
+        }
+        stats.samplerBenchmark.emplace_back(result);
+    }
+
+    settings = savedSettings;
+    resetFrame();
+}
\ No newline at end of file
@@ -5,48 +5,337 @@
 #include "geometry.h"
 #include "scene.h"
 #include "model.h"
+#include "bvh.h"
+#include "widebvh.h"
+#include "threadpool.h"
+#include "sampler.h"
+#include "aliastable.h"
+#include "denoiser.h"
 
 #include <memory>
+#include <future>
+#include <unordered_map>
 
 #include <glm/glm.hpp>
 
 class Tracer {
+public:
+    // megakernel runs the whole path of a pixel at once, wavefront runs one bounce of all paths at once
+    enum class Integrator {
+        Megakernel,
+        Wavefront
+    };
+
 private:
     struct HitPayload {
         float hitDistance;
         glm::vec3 worldPosition;
         glm::vec3 worldNormal;
+        // the plane of the triangle, the light samples find the emitters by it
+        glm::vec3 geometricNormal;
         glm::vec2 texcoords;
 
         int modelIndex;
         int meshIndex;
     };
+
+    // a path of the wavefront integrator between two bounces
+    struct PathState {
+        Ray ray;
+        glm::vec3 light;
+        glm::vec3 contribution;
+        uint32_t pixel;
+        // pdf of the direction of ray, 0 for camera rays which no light sample competes with
+        float scatterPdf;
+    };
+
+    // in object space for the emitters of a model, in world space in the light list
+    struct EmissiveTriangle {
+        glm::vec3 p0;
+        glm::vec3 edge1, edge2;
+        glm::vec3 normal;
+        glm::vec3 emission;
+    };
+
+    // a model placed in the world, the top level bvh is built over these
+    struct Instance {
+        glm::vec3 scale;
+        glm::vec3 translate;
+        glm::vec3 inverseScale;
+        AABB bounds;
+    };
 public:
     struct Settings {
         bool accumulate = false;
         int bounceTimes = 2;
+        // used when models are loaded or rebuilt
+        BVH::BuildQuality bvhQuality = BVH::BuildQuality::SAH;
+        // the top level is refitted when models move, and rebuilt in the background once its sah cost grows past this factor
+        float tlasRebuildThreshold = 1.5f;
+        TriangleKernel triangleKernel = SIMD_AVX2 ? TriangleKernel::AVX2 : SIMD_SSE ? TriangleKernel::SSE : TriangleKernel::Scalar;
+        // children per node of the model bvhs: 2, 4 or 8, every model keeps all three
+        uint32_t bvhWidth = 4;
+        // trace the primary rays of packetWidth x packetWidth pixel blocks together, the bounces stay single rays
+        bool packetTracing = true;
+        // 0 uses every hardware thread
+        uint32_t threadCount = 0;
+        // the image is rendered in tileSize x tileSize tiles, a multiple of packetWidth
+        uint32_t tileSize = 32;
+        // while accumulating, skip the tiles whose relative standard error of the luminance is below errorThreshold
+        bool adaptiveSampling = false;
+        float errorThreshold = 0.02f;
+        // samples every pixel takes before its error is trusted
+        uint32_t minSamples = 16;
+        // render nothing once every tile has converged
+        bool stopWhenConverged = true;
+        Integrator integrator = Integrator::Megakernel;
+        SamplerType sampler = SamplerType::Sobol;
+        // end paths at random by their contribution after rouletteDepth bounces, bounceTimes stays the limit
+        bool russianRoulette = true;
+        int rouletteDepth = 2;
+        // next event estimation toward the direction lights and the emissive triangles, weighted against the bounces by mis
+        bool lightSampling = true;
+        // wavefront only, shade the hits of one mesh together
+        bool sortByMaterial = false;
+        // filter the accumulated image guided by the albedo, normal and depth of the first hits, the accumulation stays noisy
+        bool denoise = false;
+        Denoiser::Settings denoiser;
+        // keep the accumulated samples of the pixels whose first hit is still in view when the camera moves, instead of starting over
+        bool reprojection = false;
+        // the first hits of a pixel before and after the move may be apart by this much relative to their distance
+        float reprojectionTolerance = 0.01f;
+        // a reprojected pixel keeps at most this many samples, so the error of snapping to the nearest pixel fades out
+        uint32_t maxReprojectedSamples = 64;
+        // after a reset, show one pixel of every 4x4 block, then of every 2x2 block, before the first full frame. Each pass is a frame
+        // of its own, so a camera move in between starts over from the coarsest one
+        bool progressive = false;
+        // keep the first hit of every pixel while the camera and the models stay where they are, the camera rays are not jittered so
+        // every frame would trace the same ones
+        bool cachePrimaryHits = true;
+    };
+
+    struct BVHBenchmarkResult {
+        int modelIndex;
+        BVH::BuildQuality quality;
+        BVHStats bvh;
+        uint32_t width;
+        uint32_t nodeCount;
+        float collapseTimeMs;
+        uint32_t rayCount;
+        float nodeVisitsPerRay;
+        float triangleTestsPerRay;
+        float traceTimeMs;
+    };
+
+    struct TriangleKernelBenchmarkResult {
+        const char *name;
+        uint64_t tests;
+        uint32_t hits;
+        float timeMs;
+    };
+
+    struct PrimaryRayBenchmarkResult {
+        const char *name;
+        uint32_t rays;
+        uint32_t hits;
+        // packets traced ray by ray because their directions do not share the signs
+        uint32_t incoherentPackets;
+        float timeMs;
     };
 
+    struct SamplerBenchmarkResult {
+        const char *name;
+        uint32_t samples;
+        // relative rms error of the luminance against the reference after all samples
+        float error;
+        float timeMs;
+        // 0 when the target error was not reached
+        uint32_t targetSamples;
+        float targetTimeMs;
+    };
+
+    struct TileTiming {
+        uint32_t x;
+        uint32_t y;
+        uint32_t threadIndex;
+        // 0 for the wavefront integrator, which does not trace per tile
+        uint32_t rayCount;
+        float timeMs;
+    };
+
+    struct WavefrontBounce {
+        uint32_t rayCount;
+        uint32_t shadowRayCount;
+        float traceTimeMs;
+        float sortTimeMs;
+        float shadeTimeMs;
+        float compactTimeMs;
+    };
+
+    struct Stats {
+        BVHStats tlas;
+        uint32_t tlasBuildCount = 0;
+        uint32_t tlasRefitCount = 0;
+        float tlasSahCost = 0.0f;
+        bool tlasRebuildPending = false;
+        std::vector<BVHBenchmarkResult> bvhBenchmark;
+        std::vector<TriangleKernelBenchmarkResult> triangleKernelBenchmark;
+        std::vector<PrimaryRayBenchmarkResult> primaryRayBenchmark;
+        std::vector<SamplerBenchmarkResult> samplerBenchmark;
+        // every tile of the last frame in the order they were scheduled, for load balance analysis
+        std::vector<TileTiming> tileTimings;
+        uint32_t threadCount = 0;
+        // tiles below the error threshold after the last frame, only counted with adaptive sampling
+        uint32_t convergedTiles = 0;
+        bool converged = false;
+        // rays traced in the last frame and the time it took, primary rays, bounces and shadow rays
+        uint64_t rayCount = 0;
+        uint64_t pathCount = 0;
+        float traceTimeMs = 0.0f;
+        // each bounce of the last frame, only filled by the wavefront integrator
+        std::vector<WavefrontBounce> wavefrontBounces;
+        uint32_t emissiveTriangleCount = 0;
+        // the light list is made again when models are added, removed or moved
+        uint32_t lightBuildCount = 0;
+        float lightBuildTimeMs = 0.0f;
+        // 0 while the denoiser is off
+        float denoiseTimeMs = 0.0f;
+        // pixels which kept their samples in the last reprojection
+        uint32_t reprojectedPixels = 0;
+        float reprojectionTimeMs = 0.0f;
+        // pixels per traced pixel of the last image, 16 and 4 for the preview passes
+        uint32_t previewScale = 1;
+        // the last frame started its paths from the cached first hits
+        bool primaryHitsCached = false;
+    };
+
+    static constexpr uint32_t packetWidth = 8;
+    static_assert(packetWidth * packetWidth <= RayPacket::maxSize, "a pixel block has to fit into one packet");
+    // the sampler benchmark accumulates each sampler this many frames against a reference of samplerReferenceSamples frames
+    static constexpr uint32_t samplerBenchmarkSamples = 64;
+    static constexpr uint32_t samplerReferenceSamples = 256;
+    static constexpr float samplerTargetError = 0.05f;
+    // paths a thread takes at once from a wavefront stream
+    static constexpr uint32_t wavefrontChunkSize = 256;
+    // 1/16, 1/4 and the rest of the pixels
+    static constexpr uint32_t previewPassCount = 3;
+
 private:
     std::shared_ptr<Image> image;
     uint32_t *imageData = nullptr;
     glm::vec4 *accumulationData = nullptr;
+    // per pixel, for the variance of the accumulated luminance
+    float *luminanceSquares = nullptr;
+    uint32_t *sampleCounts = nullptr;
+    // the first hit of the last sample of each pixel, guides the denoiser and the reprojection. The sky has a normal and depth of 0
+    glm::vec3 *albedoData = nullptr;
+    glm::vec3 *normalData = nullptr;
+    glm::vec3 *positionData = nullptr;
+    float *depthData = nullptr;
+    // the buffers reproject() gathers into, swapped with the ones above afterwards
+    glm::vec4 *reprojectedAccumulation = nullptr;
+    float *reprojectedLuminanceSquares = nullptr;
+    uint32_t *reprojectedSampleCounts = nullptr;
+    glm::vec3 *reprojectedNormals = nullptr;
+    glm::vec3 *reprojectedPositions = nullptr;
+    // of the camera the guides were written from
+    glm::mat4 viewProjection{1.0f};
+    bool cameraMoved = false;
+    // the progressive preview runs until the first frame after a reset is complete, previewPass is the next one
+    bool previewing = true;
+    uint32_t previewPass = 0;
+    // the first hit of every pixel before shading, valid until the camera or a model moves
+    std::vector<HitPayload> primaryHits;
+    bool primaryHitsValid = false;
+    // for the frame being rendered, whether the paths read their first hits from primaryHits or write them there
+    bool readPrimaryHits = false;
+    bool writePrimaryHits = false;
     int frameIndex = -1;
+    // mixed into every sampler, the sampler benchmark changes it for its reference
+    uint32_t samplerSeed = 0;
 
     const Camera *activeCamera = nullptr;
     const Scene *activeScene = nullptr;
 
-    std::vector<uint32_t> imageHorizontalIter;
-    std::vector<uint32_t> imageVerticalIter;
+    struct Tile {
+        uint32_t x, y;
+        uint32_t width, height;
+    };
+    // in morton order, so that the neighbouring tiles of each thread share the nodes they touch
+    std::vector<Tile> tiles;
+    // the largest error of a pixel in each tile, float max until all its pixels have minSamples
+    std::vector<float> tileErrors;
+    // the tile size and image size the tiles were made for
+    uint32_t tileSize = 0;
+    uint32_t tiledWidth = 0, tiledHeight = 0;
+    ThreadPool threadPool;
+    Denoiser denoiser;
+
+    // the wavefront streams, kept between frames so that they are only allocated once
+    std::vector<PathState> paths, nextPaths;
+    std::vector<HitPayload> hits;
+    std::vector<uint32_t> shadeOrder;
+    std::vector<uint8_t> pathAlive;
+    // survivors per chunk, then where each chunk writes its survivors
+    std::vector<uint32_t> chunkAliveCounts;
+
+    // the emissive triangles of each model by id, searched once when the model shows up
+    std::unordered_map<uint64_t, std::vector<EmissiveTriangle>> modelEmitters;
+    struct LitModel {
+        uint64_t id;
+        glm::vec3 scale;
+        glm::vec3 translate;
+    };
+    // the models the light list was made for
+    std::vector<LitModel> litModels;
+    std::vector<EmissiveTriangle> emissiveTriangles;
+    // picks an emissive triangle by its luminance times its area
+    AliasTable emissiveTable;
+
+    std::vector<Instance> instances;
+    BVH tlas;
+    std::future<BVH> pendingTLAS;
 public:
     Settings settings;
+    Stats stats;
 
 private:
-    glm::vec4 perPixel(uint32_t x, uint32_t y);
+    void updateInstances();
+    void updateLights();
+    static std::vector<EmissiveTriangle> findEmitters(const Model &model);
+
+    void updateTiles();
+    // returns the rays traced
+    uint32_t renderTile(const Tile &tile);
+    // all tiles which still take samples, one bounce at a time
+    void renderWavefront(bool adaptive);
+    // trace the pixels of previewPass one by one and fill the blocks of the coarse passes from them
+    void renderPreviewPass();
+    float tileError(const Tile &tile) const;
+    void writePixel(uint32_t x, uint32_t y, const glm::vec4 &color);
+    // hitPayload is null for the sky
+    void writeGuides(uint32_t pixel, const glm::vec3 &albedo, const HitPayload *hitPayload);
+    // trace the first hits of the new view and take the samples of the pixel each one was seen in before, if it is the same surface
+    void reproject();
+    // primaryHit skips tracing the first ray when it was already traced in a packet or is cached, it is not counted in rayCount
+    glm::vec4 perPixel(uint32_t x, uint32_t y, uint32_t &rayCount, const HitPayload *primaryHit = nullptr);
+    // the rays of the pixel block starting at (x, y)
+    RayPacket primaryPacket(uint32_t x, uint32_t y, uint32_t *pixelIndices) const;
 
     glm::vec3 shade(HitPayload &hitPayload);
+    // add the emission of the hit and the light samples and pick the next ray of the path, false when the path ends here.
+    // The shadow rays are added to rayCount.
+    bool scatter(HitPayload &hitPayload, const Sampler &sampler, int bounce, PathState &path, uint32_t &rayCount);
+    // light from the direction lights and one emissive triangle reflected by a surface of albedo kd
+    glm::vec3 sampleLights(const HitPayload &hitPayload, const glm::vec3 &kd, const Sampler &sampler, int bounce, uint32_t &rayCount) const;
+    // solid angle pdf of sampleLights choosing the emissive point hit by ray
+    float emissionPdf(const HitPayload &hitPayload, const Ray &ray, const glm::vec3 &emission) const;
 
     HitPayload traceRay(const Ray &ray);
+    // whether anything is hit before tMax, for shadow and visibility rays, stops at the first hit and builds no payload
+    bool occluded(const Ray &ray, float tMax) const;
+    // closest hits of all rays of the packet, an incoherent packet is traced ray by ray
+    void tracePacket(const RayPacket &packet, HitPayload *hitPayloads);
     HitPayload closestHit(const Ray &ray, float hitDistance, int modelIndex, int meshIndex, std::array<Vertex, 3> &tri, float alpha, float beta);
     HitPayload miss();
 public:
@@ -55,6 +344,17 @@ public:
     void resize(uint32_t width, uint32_t height);
     void render(const Scene &scene, const Camera &camera);
     void resetFrame();
+    // reprojects the accumulation into the new view on the next render with reprojection on, starts over otherwise
+    void moveCamera();
+
+    // build the bvh of every model with each quality and width and trace the primary rays through it alone
+    void benchmarkBVH(const Scene &scene, const Camera &camera);
+    // test primary rays against all triangles with the old array of structures test and every supported kernel
+    void benchmarkTriangleKernels(const Scene &scene, const Camera &camera);
+    // trace the primary rays on one thread ray by ray, in packets and as occlusion queries
+    void benchmarkPrimaryRays(const Scene &scene, const Camera &camera);
+    // accumulate the frame with every sampler and report the time it takes to reach samplerTargetError
+    void benchmarkSamplers(const Scene &scene, const Camera &camera);
 
 
     std::shared_ptr<Image> getImage() const { return image; }
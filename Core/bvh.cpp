@@ -0,0 +1,381 @@
+#include "bvh.h"
+#include "timer.h"
+
+#include <numeric>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <execution>
+
+struct BVH::BuildContext {
+    const std::vector<AABB> &primBounds;
+    std::vector<glm::vec3> centroids;
+    // morton code of primIndices[i], only for the fast build
+    std::vector<uint32_t> mortonCodes;
+
+    std::atomic<uint32_t> nodeCount{0};
+    std::atomic<uint32_t> leafCount{0};
+    std::atomic<uint32_t> maxDepth{0};
+    uint32_t threadCount = 1;
+    // subtrees above this depth may be handed to another thread
+    uint32_t taskDepth = 0;
+
+    BuildContext(const std::vector<AABB> &primBounds) : primBounds(primBounds) {}
+
+    uint32_t allocateNodes(uint32_t count) {
+        return nodeCount.fetch_add(count);
+    }
+
+    void addLeaf(uint32_t depth) {
+        ++leafCount;
+        uint32_t prevDepth = maxDepth.load();
+        while (prevDepth < depth && !maxDepth.compare_exchange_weak(prevDepth, depth)) {}
+    }
+};
+
+namespace {
+    struct Bin {
+        AABB bounds;
+        uint32_t count = 0;
+    };
+
+    struct AxisBins {
+        Bin bins[3][BVH::binCount];
+    };
+
+    int binIndexOf(float centroid, float boundsMin, float scale) {
+        return std::clamp((int)((centroid - boundsMin) * scale), 0, BVH::binCount - 1);
+    }
+
+    // spread the lower 10 bits so that there are two zero bits between each of them
+    uint32_t expandBits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    uint32_t mortonCode(const glm::vec3 &p) {
+        uint32_t x = (uint32_t)std::clamp(p.x * 1024.0f, 0.0f, 1023.0f);
+        uint32_t y = (uint32_t)std::clamp(p.y * 1024.0f, 0.0f, 1023.0f);
+        uint32_t z = (uint32_t)std::clamp(p.z * 1024.0f, 0.0f, 1023.0f);
+        return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+    }
+
+    int commonPrefixLength(uint32_t a, uint32_t b) {
+        uint32_t diff = a ^ b;
+        int length = 0;
+        for (uint32_t bit = 0x80000000u; bit && !(diff & bit); bit >>= 1) {
+            ++length;
+        }
+        return length;
+    }
+}
+
+void BVH::build(const std::vector<AABB> &primBounds, BuildQuality quality) {
+    Timer timer;
+
+    const uint32_t primCount = (uint32_t)primBounds.size();
+    nodes.clear();
+    primIndices.resize(primCount);
+    std::iota(primIndices.begin(), primIndices.end(), 0);
+    stats = BVHStats{};
+    stats.primCount = primCount;
+    if (primCount == 0) {
+        return;
+    }
+
+    BuildContext ctx(primBounds);
+    ctx.threadCount = std::max(1u, std::thread::hardware_concurrency());
+    // allow about two tasks per thread
+    while ((1u << ctx.taskDepth) < 2 * ctx.threadCount) {
+        ++ctx.taskDepth;
+    }
+    ctx.centroids.resize(primCount);
+    std::for_each(std::execution::par, primIndices.begin(), primIndices.end(), [&ctx, &primBounds](uint32_t i) {
+        ctx.centroids[i] = primBounds[i].centroid();
+    });
+
+    // a binary tree with n leaves at most has 2n - 1 nodes, the threads take node pairs from it
+    nodes.resize(2 * (size_t)primCount - 1);
+    BVHNode &root = nodes[ctx.allocateNodes(1)];
+    root.leftFirst = 0;
+    root.primCount = primCount;
+    updateNodeBounds(0, primBounds);
+
+    if (quality == BuildQuality::SAH) {
+        AABB centroidBounds;
+        for (const auto &c : ctx.centroids) {
+            centroidBounds.grow(c);
+        }
+        subdivide(ctx, 0, 1, centroidBounds);
+    }
+    else {
+        const AABB &bounds = nodes[0].bounds;
+        glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(std::numeric_limits<float>::min()));
+        std::vector<uint64_t> keys(primCount);
+        std::for_each(std::execution::par, primIndices.begin(), primIndices.end(), [&ctx, &keys, &bounds, &extent](uint32_t i) {
+            // code in the high bits, primitive in the low bits, so that sorting the keys sorts the primitives
+            keys[i] = ((uint64_t)mortonCode((ctx.centroids[i] - bounds.min) / extent) << 32) | i;
+        });
+        std::sort(std::execution::par, keys.begin(), keys.end());
+        ctx.mortonCodes.resize(primCount);
+        for (uint32_t i = 0; i < primCount; ++i) {
+            primIndices[i] = (uint32_t)keys[i];
+            ctx.mortonCodes[i] = (uint32_t)(keys[i] >> 32);
+        }
+        emitMortonNode(ctx, 0, 1);
+    }
+
+    nodes.resize(ctx.nodeCount);
+    nodes.shrink_to_fit();
+    stats.threadCount = ctx.threadCount;
+    stats.nodeCount = ctx.nodeCount;
+    stats.leafCount = ctx.leafCount;
+    stats.maxDepth = ctx.maxDepth;
+    stats.sahCost = sahCost();
+    stats.buildTimeMs = timer.elapsedMs();
+}
+
+void BVH::updateNodeBounds(uint32_t nodeIndex, const std::vector<AABB> &primBounds) {
+    BVHNode &node = nodes[nodeIndex];
+    node.bounds = AABB{};
+    for (uint32_t i = 0; i < node.primCount; ++i) {
+        node.bounds.grow(primBounds[primIndices[node.leftFirst + i]]);
+    }
+}
+
+float BVH::findBestSplit(BuildContext &ctx, const BVHNode &node, uint32_t depth, const AABB &centroidBounds, int &axis, int &splitBin, AABB &leftBounds, AABB &rightBounds) const {
+    glm::vec3 scale{0.0f};
+    for (int a = 0; a < 3; ++a) {
+        float extent = centroidBounds.max[a] - centroidBounds.min[a];
+        scale[a] = extent > 0.0f ? binCount / extent : 0.0f;
+    }
+    // bin all three axes in a single pass over the primitives
+    auto binRange = [&](uint32_t first, uint32_t count, AxisBins &axisBins) {
+        for (uint32_t i = first; i < first + count; ++i) {
+            uint32_t primIndex = primIndices[i];
+            const glm::vec3 &c = ctx.centroids[primIndex];
+            for (int a = 0; a < 3; ++a) {
+                Bin &bin = axisBins.bins[a][binIndexOf(c[a], centroidBounds.min[a], scale[a])];
+                bin.count++;
+                bin.bounds.grow(ctx.primBounds[primIndex]);
+            }
+        }
+    };
+
+    AxisBins axisBins;
+    auto &bins = axisBins.bins;
+    // the root is at depth 1 and each level below runs twice as many subtrees at once, so the nodes of a level share the threads
+    const uint32_t binningThreads = depth - 1 < 32 ? ctx.threadCount >> (depth - 1) : 0;
+    if (node.primCount > parallelBinningSize && binningThreads > 1) {
+        uint32_t chunkSize = (node.primCount + binningThreads - 1) / binningThreads;
+        std::vector<std::future<void>> tasks;
+        std::vector<AxisBins> chunkBins(binningThreads);
+        for (uint32_t t = 0; t < binningThreads; ++t) {
+            uint32_t first = t * chunkSize;
+            uint32_t count = first < node.primCount ? std::min(chunkSize, node.primCount - first) : 0;
+            tasks.emplace_back(std::async(std::launch::async, [&, t, first, count]() {
+                binRange(node.leftFirst + first, count, chunkBins[t]);
+            }));
+        }
+        for (uint32_t t = 0; t < binningThreads; ++t) {
+            tasks[t].get();
+            for (int a = 0; a < 3; ++a) {
+                for (int b = 0; b < binCount; ++b) {
+                    bins[a][b].count += chunkBins[t].bins[a][b].count;
+                    bins[a][b].bounds.grow(chunkBins[t].bins[a][b].bounds);
+                }
+            }
+        }
+    }
+    else {
+        binRange(node.leftFirst, node.primCount, axisBins);
+    }
+
+    float bestCost = std::numeric_limits<float>::max();
+    for (int a = 0; a < 3; ++a) {
+        if (scale[a] == 0.0f) {
+            continue;
+        }
+        // sweep the planes between the bins from both sides
+        AABB leftBox[binCount - 1], rightBox[binCount - 1];
+        uint32_t leftCount[binCount - 1], rightCount[binCount - 1];
+        AABB leftAccum, rightAccum;
+        uint32_t leftSum = 0, rightSum = 0;
+        for (int i = 0; i < binCount - 1; ++i) {
+            leftSum += bins[a][i].count;
+            leftCount[i] = leftSum;
+            leftAccum.grow(bins[a][i].bounds);
+            leftBox[i] = leftAccum;
+
+            rightSum += bins[a][binCount - 1 - i].count;
+            rightCount[binCount - 2 - i] = rightSum;
+            rightAccum.grow(bins[a][binCount - 1 - i].bounds);
+            rightBox[binCount - 2 - i] = rightAccum;
+        }
+
+        for (int i = 0; i < binCount - 1; ++i) {
+            float cost = leftCount[i] * leftBox[i].surfaceArea() + rightCount[i] * rightBox[i].surfaceArea();
+            if (leftCount[i] > 0 && rightCount[i] > 0 && cost < bestCost) {
+                bestCost = cost;
+                axis = a;
+                splitBin = i + 1;
+                leftBounds = leftBox[i];
+                rightBounds = rightBox[i];
+            }
+        }
+    }
+    return bestCost;
+}
+
+void BVH::subdivide(BuildContext &ctx, uint32_t nodeIndex, uint32_t depth, const AABB &centroidBounds) {
+    // copy the node, other threads may write its neighbours
+    BVHNode node = nodes[nodeIndex];
+    if (node.primCount <= 1 || depth >= maxDepth) {
+        ctx.addLeaf(depth);
+        return;
+    }
+
+    int axis = -1, splitBin = 0;
+    AABB leftBounds, rightBounds;
+    float splitCost = findBestSplit(ctx, node, depth, centroidBounds, axis, splitBin, leftBounds, rightBounds);
+    float leafCost = node.primCount * node.bounds.surfaceArea();
+    if (axis < 0 || splitCost * intersectionCost + traversalCost * node.bounds.surfaceArea() >= leafCost * intersectionCost) {
+        ctx.addLeaf(depth);
+        return;
+    }
+
+    // partition the primitives in place with the same binning as findBestSplit, and collect the centroid bounds of both sides
+    float boundsMin = centroidBounds.min[axis];
+    float scale = binCount / (centroidBounds.max[axis] - centroidBounds.min[axis]);
+    AABB leftCentroidBounds, rightCentroidBounds;
+    uint32_t i = node.leftFirst;
+    uint32_t j = node.leftFirst + node.primCount;
+    while (i < j) {
+        const glm::vec3 &c = ctx.centroids[primIndices[i]];
+        if (binIndexOf(c[axis], boundsMin, scale) < splitBin) {
+            leftCentroidBounds.grow(c);
+            ++i;
+        }
+        else {
+            rightCentroidBounds.grow(c);
+            std::swap(primIndices[i], primIndices[--j]);
+        }
+    }
+    uint32_t leftCount = i - node.leftFirst;
+    if (leftCount == 0 || leftCount == node.primCount) {
+        ctx.addLeaf(depth);
+        return;
+    }
+
+    uint32_t leftIndex = ctx.allocateNodes(2);
+    BVHNode &left = nodes[leftIndex];
+    BVHNode &right = nodes[leftIndex + 1];
+    left.bounds = leftBounds;
+    left.leftFirst = node.leftFirst;
+    left.primCount = leftCount;
+    right.bounds = rightBounds;
+    right.leftFirst = i;
+    right.primCount = node.primCount - leftCount;
+    nodes[nodeIndex].leftFirst = leftIndex;
+    nodes[nodeIndex].primCount = 0;
+
+    if (depth < ctx.taskDepth && node.primCount > parallelSubtreeSize) {
+        auto task = std::async(std::launch::async, [&ctx, this, leftIndex, depth, &leftCentroidBounds]() {
+            subdivide(ctx, leftIndex, depth + 1, leftCentroidBounds);
+        });
+        subdivide(ctx, leftIndex + 1, depth + 1, rightCentroidBounds);
+        task.get();
+    }
+    else {
+        subdivide(ctx, leftIndex, depth + 1, leftCentroidBounds);
+        subdivide(ctx, leftIndex + 1, depth + 1, rightCentroidBounds);
+    }
+}
+
+void BVH::emitMortonNode(BuildContext &ctx, uint32_t nodeIndex, uint32_t depth) {
+    BVHNode node = nodes[nodeIndex];
+    if (node.primCount <= fastLeafSize || depth >= maxDepth) {
+        updateNodeBounds(nodeIndex, ctx.primBounds);
+        ctx.addLeaf(depth);
+        return;
+    }
+
+    // split where the highest bit that differs inside the range flips, the codes are sorted
+    uint32_t first = node.leftFirst, last = node.leftFirst + node.primCount - 1;
+    uint32_t firstCode = ctx.mortonCodes[first], lastCode = ctx.mortonCodes[last];
+    uint32_t split = first + node.primCount / 2 - 1;
+    if (firstCode != lastCode) {
+        int prefix = commonPrefixLength(firstCode, lastCode);
+        split = first;
+        uint32_t step = last - first;
+        do {
+            step = (step + 1) >> 1;
+            uint32_t newSplit = split + step;
+            if (newSplit < last && commonPrefixLength(firstCode, ctx.mortonCodes[newSplit]) > prefix) {
+                split = newSplit;
+            }
+        } while (step > 1);
+    }
+
+    uint32_t leftIndex = ctx.allocateNodes(2);
+    BVHNode &left = nodes[leftIndex];
+    BVHNode &right = nodes[leftIndex + 1];
+    left.leftFirst = first;
+    left.primCount = split - first + 1;
+    right.leftFirst = split + 1;
+    right.primCount = last - split;
+    nodes[nodeIndex].leftFirst = leftIndex;
+    nodes[nodeIndex].primCount = 0;
+
+    if (depth < ctx.taskDepth && node.primCount > parallelSubtreeSize) {
+        auto task = std::async(std::launch::async, [&ctx, this, leftIndex, depth]() {
+            emitMortonNode(ctx, leftIndex, depth + 1);
+        });
+        emitMortonNode(ctx, leftIndex + 1, depth + 1);
+        task.get();
+    }
+    else {
+        emitMortonNode(ctx, leftIndex, depth + 1);
+        emitMortonNode(ctx, leftIndex + 1, depth + 1);
+    }
+
+    // the bounds are collected bottom-up once both children are done
+    AABB bounds = nodes[leftIndex].bounds;
+    bounds.grow(nodes[leftIndex + 1].bounds);
+    nodes[nodeIndex].bounds = bounds;
+}
+
+float BVH::refit(const std::vector<AABB> &primBounds) {
+    // children are always allocated after their parent, so walking backwards visits them first
+    for (size_t i = nodes.size(); i-- > 0;) {
+        BVHNode &node = nodes[i];
+        if (node.isLeaf()) {
+            updateNodeBounds((uint32_t)i, primBounds);
+        }
+        else {
+            node.bounds = nodes[node.leftFirst].bounds;
+            node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+        }
+    }
+    return sahCost();
+}
+
+float BVH::sahCost() const {
+    if (nodes.empty()) {
+        return 0.0f;
+    }
+    float cost = 0.0f;
+    for (const auto &node : nodes) {
+        if (node.isLeaf()) {
+            cost += intersectionCost * node.primCount * node.bounds.surfaceArea();
+        }
+        else {
+            cost += traversalCost * node.bounds.surfaceArea();
+        }
+    }
+    float rootArea = nodes[0].bounds.surfaceArea();
+    return rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
\ No newline at end of file
@@ -0,0 +1,330 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "geometry.h"
+
+struct AABB {
+    glm::vec3 min{std::numeric_limits<float>::max()};
+    glm::vec3 max{-std::numeric_limits<float>::max()};
+
+    void grow(const glm::vec3 &p) {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+
+    void grow(const AABB &b) {
+        min = glm::min(min, b.min);
+        max = glm::max(max, b.max);
+    }
+
+    bool valid() const {
+        return min.x <= max.x && min.y <= max.y && min.z <= max.z;
+    }
+
+    glm::vec3 centroid() const {
+        return (min + max) * 0.5f;
+    }
+
+    float surfaceArea() const {
+        if (!valid()) {
+            return 0.0f;
+        }
+        glm::vec3 e = max - min;
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    // slab test, return the entry distance or float max if the ray misses the box before hitDistance
+    float intersect(const Ray &ray, const glm::vec3 &invDir, float hitDistance) const {
+        glm::vec3 t1 = (min - ray.origin) * invDir;
+        glm::vec3 t2 = (max - ray.origin) * invDir;
+        float tNear = std::max(std::max(std::min(t1.x, t2.x), std::min(t1.y, t2.y)), std::min(t1.z, t2.z));
+        float tFar = std::min(std::min(std::max(t1.x, t2.x), std::max(t1.y, t2.y)), std::max(t1.z, t2.z));
+        if (tFar >= tNear && tNear < hitDistance && tFar > 0.0f) {
+            return tNear;
+        }
+        return std::numeric_limits<float>::max();
+    }
+};
+
+// Rays with a common origin whose directions have the same sign on every axis, like the primary rays of a pixel block.
+// The inverse directions are bounded per axis, so one interval test tells whether any ray of the packet may hit a box.
+struct RayPacket {
+    static constexpr uint32_t maxSize = 64;
+
+    glm::vec3 origin;
+    glm::vec3 directions[maxSize];
+    glm::vec3 invDirections[maxSize];
+    uint32_t size = 0;
+    glm::vec3 minInvDir;
+    glm::vec3 maxInvDir;
+    // false if the directions do not share their signs, the packet has to be traced ray by ray then
+    bool coherent = false;
+
+    // call once the origin and the directions are set
+    void finalize() {
+        minInvDir = glm::vec3(std::numeric_limits<float>::max());
+        maxInvDir = glm::vec3(-std::numeric_limits<float>::max());
+        glm::vec3 positive{0.0f}, negative{0.0f};
+        for (uint32_t i = 0; i < size; ++i) {
+            invDirections[i] = 1.0f / directions[i];
+            minInvDir = glm::min(minInvDir, invDirections[i]);
+            maxInvDir = glm::max(maxInvDir, invDirections[i]);
+            for (int a = 0; a < 3; ++a) {
+                positive[a] += directions[i][a] > 0.0f ? 1.0f : 0.0f;
+                negative[a] += directions[i][a] < 0.0f ? 1.0f : 0.0f;
+            }
+        }
+        coherent = size > 0;
+        for (int a = 0; a < 3; ++a) {
+            coherent = coherent && (positive[a] == size || negative[a] == size);
+        }
+    }
+
+    // Conservative entry distance of the packet into the box, or float max if no ray of the packet can hit it before maxHitDistance.
+    // The near plane of every axis is the same for all rays, so the bounds of the inverse directions bound the slab distances.
+    float intersect(const AABB &box, float maxHitDistance) const {
+        float tNear = 0.0f, tFar = std::numeric_limits<float>::max();
+        for (int a = 0; a < 3; ++a) {
+            bool negativeAxis = minInvDir[a] < 0.0f;
+            float nearDelta = (negativeAxis ? box.max[a] : box.min[a]) - origin[a];
+            float farDelta = (negativeAxis ? box.min[a] : box.max[a]) - origin[a];
+            tNear = std::max(tNear, nearDelta >= 0.0f ? nearDelta * minInvDir[a] : nearDelta * maxInvDir[a]);
+            tFar = std::min(tFar, farDelta >= 0.0f ? farDelta * maxInvDir[a] : farDelta * minInvDir[a]);
+        }
+        if (tNear <= tFar && tNear < maxHitDistance) {
+            return tNear;
+        }
+        return std::numeric_limits<float>::max();
+    }
+};
+
+struct BVHNode {
+    AABB bounds;
+    // index of the left child (the right one follows it) for inner nodes, index of the first primitive for leaves
+    uint32_t leftFirst = 0;
+    // 0 for inner nodes
+    uint32_t primCount = 0;
+
+    bool isLeaf() const { return primCount > 0; }
+};
+
+struct BVHStats {
+    uint32_t threadCount = 0;
+    uint32_t primCount = 0;
+    uint32_t nodeCount = 0;
+    uint32_t leafCount = 0;
+    uint32_t maxDepth = 0;
+    float sahCost = 0.0f;
+    float buildTimeMs = 0.0f;
+};
+
+// Binary bounding volume hierarchy built with the binned surface area heuristic or from morton codes (lbvh).
+// It only knows the bounds of the primitives, the caller tests the primitives referenced by the leaves.
+class BVH {
+public:
+    enum class BuildQuality { Fast, SAH };
+
+    static constexpr uint32_t maxDepth = 64;
+    static constexpr int binCount = 16;
+    static constexpr float traversalCost = 1.0f;
+    static constexpr float intersectionCost = 1.0f;
+    // subtrees with more primitives than this are built by another thread
+    static constexpr uint32_t parallelSubtreeSize = 4096;
+    // nodes with more primitives than this are binned by several threads
+    static constexpr uint32_t parallelBinningSize = 65536;
+    // leaf size of the fast build, which does not evaluate the sah
+    static constexpr uint32_t fastLeafSize = 4;
+
+private:
+    struct BuildContext;
+
+    void updateNodeBounds(uint32_t nodeIndex, const std::vector<AABB> &primBounds);
+    void subdivide(BuildContext &ctx, uint32_t nodeIndex, uint32_t depth, const AABB &centroidBounds);
+    float findBestSplit(BuildContext &ctx, const BVHNode &node, uint32_t depth, const AABB &centroidBounds, int &axis, int &splitBin, AABB &leftBounds, AABB &rightBounds) const;
+    void emitMortonNode(BuildContext &ctx, uint32_t nodeIndex, uint32_t depth);
+
+public:
+    std::vector<BVHNode> nodes;
+    // leaves reference contiguous ranges of this array
+    std::vector<uint32_t> primIndices;
+    BVHStats stats;
+
+public:
+    void build(const std::vector<AABB> &primBounds, BuildQuality quality = BuildQuality::SAH);
+    float sahCost() const;
+    // update the bounds bottom-up for moved primitives without changing the topology, return the new sah cost
+    float refit(const std::vector<AABB> &primBounds);
+
+    bool empty() const { return nodes.empty(); }
+
+    // leafTest(first, count, hitDistance) tests the primitives referenced by primIndices[first, first + count) and
+    // shrinks hitDistance when it finds a closer hit, nodeVisits counts the visited nodes for benchmarking
+    template<typename LeafTest>
+    void traverseLeaves(const Ray &ray, float &hitDistance, LeafTest &&leafTest, uint32_t *nodeVisits = nullptr) const {
+        if (nodes.empty()) {
+            return;
+        }
+        const glm::vec3 invDir = 1.0f / ray.direction;
+        if (nodes[0].bounds.intersect(ray, invDir, hitDistance) == std::numeric_limits<float>::max()) {
+            return;
+        }
+
+        struct StackEntry {
+            uint32_t nodeIndex;
+            float distance;
+        };
+        StackEntry stack[maxDepth];
+        uint32_t stackSize = 0;
+        uint32_t nodeIndex = 0;
+        while (true) {
+            const BVHNode &node = nodes[nodeIndex];
+            if (nodeVisits) {
+                ++*nodeVisits;
+            }
+            if (node.isLeaf()) {
+                leafTest(node.leftFirst, node.primCount, hitDistance);
+            }
+            else {
+                uint32_t nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+                float nearDistance = nodes[nearChild].bounds.intersect(ray, invDir, hitDistance);
+                float farDistance = nodes[farChild].bounds.intersect(ray, invDir, hitDistance);
+                if (nearDistance > farDistance) {
+                    std::swap(nearChild, farChild);
+                    std::swap(nearDistance, farDistance);
+                }
+                if (nearDistance != std::numeric_limits<float>::max()) {
+                    if (farDistance != std::numeric_limits<float>::max()) {
+                        stack[stackSize++] = {farChild, farDistance};
+                    }
+                    nodeIndex = nearChild;
+                    continue;
+                }
+            }
+            // pop the next node which may still be in front of the closest hit
+            while (stackSize > 0 && stack[stackSize - 1].distance >= hitDistance) {
+                --stackSize;
+            }
+            if (stackSize == 0) {
+                break;
+            }
+            nodeIndex = stack[--stackSize].nodeIndex;
+        }
+    }
+
+    // Any hit traversal for occlusion queries. leafTest(first, count, tMax) returns true if a primitive of the leaf is hit
+    // before tMax, which ends the traversal. The children are not sorted, the first hit found is enough.
+    template<typename LeafTest>
+    bool traverseAny(const Ray &ray, float tMax, LeafTest &&leafTest, uint32_t *nodeVisits = nullptr) const {
+        if (nodes.empty()) {
+            return false;
+        }
+        const glm::vec3 invDir = 1.0f / ray.direction;
+        uint32_t stack[maxDepth];
+        uint32_t stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0) {
+            const BVHNode &node = nodes[stack[--stackSize]];
+            if (nodeVisits) {
+                ++*nodeVisits;
+            }
+            if (node.bounds.intersect(ray, invDir, tMax) == std::numeric_limits<float>::max()) {
+                continue;
+            }
+            if (node.isLeaf()) {
+                if (leafTest(node.leftFirst, node.primCount, tMax)) {
+                    return true;
+                }
+            }
+            else {
+                stack[stackSize++] = node.leftFirst + 1;
+                stack[stackSize++] = node.leftFirst;
+            }
+        }
+        return false;
+    }
+
+    // Trace a coherent packet, hitDistances holds one distance per ray. leafTest(first, count, rayMask, hitDistances) tests the
+    // primitives of a leaf against the rays of rayMask, which passed their own slab test against the leaf bounds.
+    // The nodes are culled for the whole packet, so each node is fetched once for all its rays.
+    template<typename LeafTest>
+    void traversePacket(const RayPacket &packet, float *hitDistances, LeafTest &&leafTest, uint32_t *nodeVisits = nullptr) const {
+        if (nodes.empty()) {
+            return;
+        }
+        float maxHitDistance = 0.0f;
+        for (uint32_t i = 0; i < packet.size; ++i) {
+            maxHitDistance = std::max(maxHitDistance, hitDistances[i]);
+        }
+        if (packet.intersect(nodes[0].bounds, maxHitDistance) == std::numeric_limits<float>::max()) {
+            return;
+        }
+
+        struct StackEntry {
+            uint32_t nodeIndex;
+            float distance;
+        };
+        StackEntry stack[maxDepth];
+        uint32_t stackSize = 0;
+        uint32_t nodeIndex = 0;
+        while (true) {
+            const BVHNode &node = nodes[nodeIndex];
+            if (nodeVisits) {
+                ++*nodeVisits;
+            }
+            if (node.isLeaf()) {
+                uint64_t rayMask = 0;
+                for (uint32_t i = 0; i < packet.size; ++i) {
+                    Ray ray{packet.origin, packet.directions[i]};
+                    if (node.bounds.intersect(ray, packet.invDirections[i], hitDistances[i]) != std::numeric_limits<float>::max()) {
+                        rayMask |= 1ull << i;
+                    }
+                }
+                if (rayMask) {
+                    leafTest(node.leftFirst, node.primCount, rayMask, hitDistances);
+                    maxHitDistance = 0.0f;
+                    for (uint32_t i = 0; i < packet.size; ++i) {
+                        maxHitDistance = std::max(maxHitDistance, hitDistances[i]);
+                    }
+                }
+            }
+            else {
+                uint32_t nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+                float nearDistance = packet.intersect(nodes[nearChild].bounds, maxHitDistance);
+                float farDistance = packet.intersect(nodes[farChild].bounds, maxHitDistance);
+                if (nearDistance > farDistance) {
+                    std::swap(nearChild, farChild);
+                    std::swap(nearDistance, farDistance);
+                }
+                if (nearDistance != std::numeric_limits<float>::max()) {
+                    if (farDistance != std::numeric_limits<float>::max()) {
+                        stack[stackSize++] = {farChild, farDistance};
+                    }
+                    nodeIndex = nearChild;
+                    continue;
+                }
+            }
+            // the farthest hit of the packet bounds what may still be in front
+            while (stackSize > 0 && stack[stackSize - 1].distance >= maxHitDistance) {
+                --stackSize;
+            }
+            if (stackSize == 0) {
+                break;
+            }
+            nodeIndex = stack[--stackSize].nodeIndex;
+        }
+    }
+
+    // primitiveTest(primIndex, hitDistance) tests one primitive and shrinks hitDistance when it finds a closer hit
+    template<typename PrimitiveTest>
+    void traverse(const Ray &ray, float &hitDistance, PrimitiveTest &&primitiveTest, uint32_t *nodeVisits = nullptr) const {
+        traverseLeaves(ray, hitDistance, [this, &primitiveTest](uint32_t first, uint32_t count, float &closest) {
+            for (uint32_t i = first; i < first + count; ++i) {
+                primitiveTest(primIndices[i], closest);
+            }
+        }, nodeVisits);
+    }
+};
\ No newline at end of file
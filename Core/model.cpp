@@ -1,5 +1,6 @@
 #include "model.h"
 #include <iostream>
+#include <atomic>
 
 static Texture textureFromFile(const char *filename, const std::string &directory) {
     std::string path = std::string(filename);
@@ -54,6 +55,52 @@ void Model::loadModel(const std::string &path) {
     processNode(scene->mRootNode, scene);
 }
 
+static std::vector<AABB> triangleBoundsOf(const std::vector<Mesh> &meshes, const std::vector<TriangleRef> &triangles) {
+    std::vector<AABB> triangleBounds(triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        const auto &mesh = meshes[triangles[i].meshIndex];
+        const uint32_t k = triangles[i].firstIndex;
+        triangleBounds[i].grow(mesh.vertices[mesh.indices[k]].position);
+        triangleBounds[i].grow(mesh.vertices[mesh.indices[k + 1]].position);
+        triangleBounds[i].grow(mesh.vertices[mesh.indices[k + 2]].position);
+    }
+    return triangleBounds;
+}
+
+std::vector<AABB> Model::getTriangleBounds() const {
+    return triangleBoundsOf(meshes, triangles);
+}
+
+ModelBVH Model::buildBVH(BVH::BuildQuality quality) const {
+    ModelBVH built;
+    built.quality = quality;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        for (size_t k = 0; k + 2 < meshes[i].indices.size(); k += 3) {
+            built.triangles.push_back({(uint32_t)i, (uint32_t)k});
+        }
+    }
+    built.bvh.build(triangleBoundsOf(meshes, built.triangles), quality);
+    built.bvh4.collapse(built.bvh);
+    built.bvh8.collapse(built.bvh);
+
+    for (uint32_t triIndex : built.bvh.primIndices) {
+        const auto &mesh = meshes[built.triangles[triIndex].meshIndex];
+        const uint32_t k = built.triangles[triIndex].firstIndex;
+        built.triangleStore.add(mesh.vertices[mesh.indices[k]].position, mesh.vertices[mesh.indices[k + 1]].position, mesh.vertices[mesh.indices[k + 2]].position);
+    }
+    built.triangleStore.pad();
+    return built;
+}
+
+void Model::setBVH(ModelBVH &&built) {
+    bvhQuality = built.quality;
+    triangles = std::move(built.triangles);
+    bvh = std::move(built.bvh);
+    bvh4 = std::move(built.bvh4);
+    bvh8 = std::move(built.bvh8);
+    triangleStore = std::move(built.triangleStore);
+}
+
 void Model::processNode(aiNode *node, const aiScene *scene) {
     for (unsigned int i = 0; i < node->mNumMeshes; ++i) {
         aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
@@ -168,6 +215,10 @@ std::vector<Texture> Model::loadMaterialTextures(aiMaterial *mat, aiTextureType
     return textures;
 }
 
-Model::Model(const std::string &path) {
+Model::Model(const std::string &path, BVH::BuildQuality bvhQuality) {
+    // models are loaded off the ui thread
+    static std::atomic<uint64_t> nextId{1};
+    id = nextId++;
     loadModel(path);
+    setBVH(buildBVH(bvhQuality));
 }
\ No newline at end of file
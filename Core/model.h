@@ -6,9 +6,29 @@
 #include <stb_image.h>
 
 #include "mesh.h"
+#include "bvh.h"
+#include "widebvh.h"
+#include "triangles.h"
 
 Texture textureFromFile(const char *path, const std::string &directory);
 
+// a triangle of the model, referenced by the leaves of its bvh
+struct TriangleRef {
+    uint32_t meshIndex;
+    // index of the first vertex index of the triangle in mesh.indices
+    uint32_t firstIndex;
+};
+
+// the tracer structures of a model, built from its geometry only so that they can be rebuilt off the ui thread
+struct ModelBVH {
+    BVH::BuildQuality quality;
+    std::vector<TriangleRef> triangles;
+    BVH bvh;
+    WideBVH<4> bvh4;
+    WideBVH<8> bvh8;
+    TriangleStore triangleStore;
+};
+
 class Model {
     void loadModel(const std::string &path);
 
@@ -24,6 +44,23 @@ public:
     std::string directory;
     glm::vec3 scale{1.0f};
     glm::vec3 translate{0.0f};
+    // unique for every loaded model and kept by copies and moves, so that the bvhs rebuilt off the ui thread find their model again
+    uint64_t id;
+
+    // only for tracer, built in object space once the model is loaded
+    BVH::BuildQuality bvhQuality;
+    std::vector<TriangleRef> triangles;
+    BVH bvh;
+    // bvh collapsed into 4 and 8 wide nodes, with the same leaves
+    WideBVH<4> bvh4;
+    WideBVH<8> bvh8;
+    // positions of the triangles in the order of bvh.primIndices, so that each leaf is a contiguous range
+    TriangleStore triangleStore;
+
+    Model(const std::string &path, BVH::BuildQuality bvhQuality = BVH::BuildQuality::SAH);
 
-    Model(const std::string &path);
+    std::vector<AABB> getTriangleBounds() const;
+    // only reads the meshes, may run on another thread while the model is in use
+    ModelBVH buildBVH(BVH::BuildQuality quality = BVH::BuildQuality::SAH) const;
+    void setBVH(ModelBVH &&built);
 };
\ No newline at end of file
@@ -2,6 +2,9 @@
 
 Renderer::Renderer() {
     tracerSettings = &tracer.settings;
+    tracerStats = &tracer.stats;
+    rasterizerSettings = &rasterizer.settings;
+    rasterizerStats = &rasterizer.stats;
 }
 
 void Renderer::resize(uint32_t width, uint32_t height) {
@@ -23,3 +26,31 @@ void Renderer::render(const Scene &scene, const Camera &camera) {
 void Renderer::resetTracerFrame() {
     tracer.resetFrame();
 }
+
+void Renderer::moveTracerCamera() {
+    tracer.moveCamera();
+}
+
+void Renderer::benchmarkTracerBVH(const Scene &scene, const Camera &camera) {
+    tracer.benchmarkBVH(scene, camera);
+}
+
+void Renderer::benchmarkTracerTriangleKernels(const Scene &scene, const Camera &camera) {
+    tracer.benchmarkTriangleKernels(scene, camera);
+}
+
+void Renderer::benchmarkTracerPrimaryRays(const Scene &scene, const Camera &camera) {
+    tracer.benchmarkPrimaryRays(scene, camera);
+}
+
+void Renderer::benchmarkTracerSamplers(const Scene &scene, const Camera &camera) {
+    tracer.benchmarkSamplers(scene, camera);
+}
+
+void Renderer::benchmarkRasterizerScaling(const Scene &scene, const Camera &camera) {
+    rasterizer.benchmarkScaling(scene, camera);
+}
+
+void Renderer::benchmarkRasterizerTriangleSizes(const Camera &camera) {
+    rasterizer.benchmarkTriangleSizes(camera);
+}
\ No newline at end of file
@@ -20,6 +20,9 @@ private:
     std::shared_ptr<Image> image;
 public:
     Tracer::Settings *tracerSettings = nullptr;
+    const Tracer::Stats *tracerStats = nullptr;
+    Rasterizer::Settings *rasterizerSettings = nullptr;
+    const Rasterizer::Stats *rasterizerStats = nullptr;
 
     Settings rendererSettings;
 public:
@@ -28,6 +31,13 @@ public:
     void resize(uint32_t width, uint32_t height);
     void render(const Scene &scene, const Camera &camera);
     void resetTracerFrame();
+    void moveTracerCamera();
+    void benchmarkTracerBVH(const Scene &scene, const Camera &camera);
+    void benchmarkTracerTriangleKernels(const Scene &scene, const Camera &camera);
+    void benchmarkTracerPrimaryRays(const Scene &scene, const Camera &camera);
+    void benchmarkTracerSamplers(const Scene &scene, const Camera &camera);
+    void benchmarkRasterizerScaling(const Scene &scene, const Camera &camera);
+    void benchmarkRasterizerTriangleSizes(const Camera &camera);
 
     std::shared_ptr<Image> getImage() const { return image; }
 };
\ No newline at end of file
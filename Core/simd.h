@@ -0,0 +1,16 @@
+#pragma once
+
+// The instruction sets the simd paths may use, decided by the compiler flags (see ENABLE_AVX2 in CMakeLists.txt).
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE 1
+#include <emmintrin.h>
+#else
+#define SIMD_SSE 0
+#endif
+
+#if defined(__AVX2__)
+#define SIMD_AVX2 1
+#include <immintrin.h>
+#else
+#define SIMD_AVX2 0
+#endif
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(uint32_t threadCount) {
+    resize(threadCount);
+}
+
+ThreadPool::~ThreadPool() {
+    resize(1);
+}
+
+uint32_t ThreadPool::hardwareThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void ThreadPool::resize(uint32_t threadCount) {
+    if (threadCount == 0) {
+        threadCount = hardwareThreads();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    stopping = false;
+    ranges.clear();
+    for (uint32_t i = 0; i < threadCount; ++i) {
+        ranges.emplace_back(std::make_unique<Range>());
+    }
+    // the calling thread is thread 0
+    for (uint32_t i = 1; i < threadCount; ++i) {
+        // no loop runs here, so the workers start from the current generation
+        workers.emplace_back(&ThreadPool::workerLoop, this, i, generation);
+    }
+}
+
+void ThreadPool::parallelFor(uint32_t count, const Task &task) {
+    if (count == 0) {
+        return;
+    }
+    const uint32_t threads = threadCount();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t i = 0; i < threads; ++i) {
+            std::lock_guard<std::mutex> rangeLock(ranges[i]->mutex);
+            ranges[i]->begin = (uint32_t)((uint64_t)count * i / threads);
+            ranges[i]->end = (uint32_t)((uint64_t)count * (i + 1) / threads);
+        }
+        this->task = &task;
+        busyThreads = threads;
+        ++generation;
+    }
+    wake.notify_all();
+
+    runTasks(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return busyThreads == 0; });
+    this->task = nullptr;
+}
+
+void ThreadPool::workerLoop(uint32_t threadIndex, uint64_t seenGeneration) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this, seenGeneration]() { return stopping || generation != seenGeneration; });
+            if (stopping) {
+                return;
+            }
+            seenGeneration = generation;
+        }
+        runTasks(threadIndex);
+    }
+}
+
+void ThreadPool::runTasks(uint32_t threadIndex) {
+    uint32_t index;
+    while (takeIndex(threadIndex, index)) {
+        (*task)(index, threadIndex);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--busyThreads == 0) {
+        done.notify_all();
+    }
+}
+
+bool ThreadPool::takeIndex(uint32_t threadIndex, uint32_t &index) {
+    {
+        Range &own = *ranges[threadIndex];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (own.begin < own.end) {
+            index = own.begin++;
+            return true;
+        }
+    }
+    // steal from the back of the range with the most indices left
+    while (true) {
+        uint32_t victim = 0, most = 0;
+        for (uint32_t i = 0; i < ranges.size(); ++i) {
+            std::lock_guard<std::mutex> lock(ranges[i]->mutex);
+            uint32_t left = ranges[i]->end - ranges[i]->begin;
+            if (left > most) {
+                most = left;
+                victim = i;
+            }
+        }
+        if (most == 0) {
+            return false;
+        }
+        Range &range = *ranges[victim];
+        std::lock_guard<std::mutex> lock(range.mutex);
+        // it may have been emptied since
+        if (range.begin < range.end) {
+            index = --range.end;
+            return true;
+        }
+    }
+}
\ No newline at end of file
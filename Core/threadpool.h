@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+// Fixed set of worker threads for parallel loops. Each thread owns a contiguous range of the indices and takes them from the front,
+// a thread whose range is empty steals from the back of the others, so uneven items still balance out.
+class ThreadPool {
+public:
+    // task(index, threadIndex), threadIndex is in [0, threadCount()) and the calling thread is 0
+    using Task = std::function<void(uint32_t, uint32_t)>;
+
+private:
+    struct Range {
+        std::mutex mutex;
+        uint32_t begin = 0;
+        uint32_t end = 0;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Range>> ranges;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const Task *task = nullptr;
+    uint64_t generation = 0;
+    // threads still working on the current loop
+    uint32_t busyThreads = 0;
+    bool stopping = false;
+
+    void workerLoop(uint32_t threadIndex, uint64_t seenGeneration);
+    void runTasks(uint32_t threadIndex);
+    bool takeIndex(uint32_t threadIndex, uint32_t &index);
+
+public:
+    // 0 uses every hardware thread
+    explicit ThreadPool(uint32_t threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void resize(uint32_t threadCount);
+    uint32_t threadCount() const { return (uint32_t)ranges.size(); }
+
+    // run task for every index in [0, count) and return once all are done, not reentrant
+    void parallelFor(uint32_t count, const Task &task);
+
+    static uint32_t hardwareThreads();
+};
\ No newline at end of file
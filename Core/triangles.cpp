@@ -0,0 +1,231 @@
+#include "triangles.h"
+
+void TriangleStore::add(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2) {
+    glm::vec3 e1 = p1 - p0;
+    glm::vec3 e2 = p2 - p0;
+    v0x.push_back(p0.x);
+    v0y.push_back(p0.y);
+    v0z.push_back(p0.z);
+    e1x.push_back(e1.x);
+    e1y.push_back(e1.y);
+    e1z.push_back(e1.z);
+    e2x.push_back(e2.x);
+    e2y.push_back(e2.y);
+    e2z.push_back(e2.z);
+    ++triangleCount;
+}
+
+void TriangleStore::pad() {
+    // zero edges give a zero determinant, which every kernel rejects
+    for (auto *a : {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z}) {
+        a->resize(triangleCount + padding, 0.0f);
+    }
+}
+
+bool TriangleStore::isKernelSupported(TriangleKernel kernel) {
+    switch (kernel) {
+        case TriangleKernel::SSE:
+            return SIMD_SSE;
+        case TriangleKernel::AVX2:
+            return SIMD_AVX2;
+        default:
+            return true;
+    }
+}
+
+const char *TriangleStore::kernelName(TriangleKernel kernel) {
+    switch (kernel) {
+        case TriangleKernel::SSE:
+            return "sse";
+        case TriangleKernel::AVX2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
+
+int TriangleStore::intersect(const Ray &ray, uint32_t first, uint32_t count, float &hitDistance, float &u, float &v, TriangleKernel kernel) const {
+    switch (kernel) {
+        case TriangleKernel::AVX2:
+            return intersectAVX2(ray, first, count, hitDistance, u, v);
+        case TriangleKernel::SSE:
+            return intersectSSE(ray, first, count, hitDistance, u, v);
+        default:
+            return intersectScalar(ray, first, count, hitDistance, u, v);
+    }
+}
+
+bool TriangleStore::occluded(const Ray &ray, uint32_t first, uint32_t count, float tMax, TriangleKernel kernel) const {
+    float u, v;
+    switch (kernel) {
+        case TriangleKernel::AVX2:
+            return intersectAVX2(ray, first, count, tMax, u, v, true) >= 0;
+        case TriangleKernel::SSE:
+            return intersectSSE(ray, first, count, tMax, u, v, true) >= 0;
+        default:
+            return intersectScalar(ray, first, count, tMax, u, v, true) >= 0;
+    }
+}
+
+int TriangleStore::intersectScalar(const Ray &ray, uint32_t first, uint32_t count, float &hitDistance, float &u, float &v, bool anyHit) const {
+    int hitIndex = -1;
+    const glm::vec3 &d = ray.direction;
+    for (uint32_t i = first; i < first + count; ++i) {
+        glm::vec3 e1{e1x[i], e1y[i], e1z[i]};
+        glm::vec3 e2{e2x[i], e2y[i], e2z[i]};
+        glm::vec3 p = glm::cross(d, e2);
+        float det = glm::dot(e1, p);
+        if (det == 0.0f) {
+            continue;
+        }
+        float invDet = 1.0f / det;
+        glm::vec3 t = ray.origin - glm::vec3{v0x[i], v0y[i], v0z[i]};
+        float triU = glm::dot(t, p) * invDet;
+        if (triU < 0.0f || triU > 1.0f) {
+            continue;
+        }
+        glm::vec3 q = glm::cross(t, e1);
+        float triV = glm::dot(d, q) * invDet;
+        if (triV < 0.0f || triU + triV > 1.0f) {
+            continue;
+        }
+        float distance = glm::dot(e2, q) * invDet;
+        if (distance < 0.0f || distance >= hitDistance) {
+            continue;
+        }
+        hitDistance = distance;
+        u = triU;
+        v = triV;
+        hitIndex = (int)i;
+        if (anyHit) {
+            break;
+        }
+    }
+    return hitIndex;
+}
+
+int TriangleStore::intersectSSE(const Ray &ray, uint32_t first, uint32_t count, float &hitDistance, float &u, float &v, bool anyHit) const {
+#if SIMD_SSE
+    const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+
+    int hitIndex = -1;
+    for (uint32_t i = first; i < first + count; i += 4) {
+        __m128 ax = _mm_loadu_ps(&e1x[i]), ay = _mm_loadu_ps(&e1y[i]), az = _mm_loadu_ps(&e1z[i]);
+        __m128 bx = _mm_loadu_ps(&e2x[i]), by = _mm_loadu_ps(&e2y[i]), bz = _mm_loadu_ps(&e2z[i]);
+        // p = d x e2
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, bz), _mm_mul_ps(dz, by));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, bx), _mm_mul_ps(dx, bz));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, by), _mm_mul_ps(dy, bx));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, px), _mm_mul_ps(ay, py)), _mm_mul_ps(az, pz));
+        __m128 invDet = _mm_div_ps(one, det);
+        // t = o - v0
+        __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(&v0x[i]));
+        __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(&v0y[i]));
+        __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(&v0z[i]));
+        __m128 triU = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+        // q = t x e1
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, az), _mm_mul_ps(tz, ay));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, ax), _mm_mul_ps(tx, az));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, ay), _mm_mul_ps(ty, ax));
+        __m128 triV = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+        __m128 distance = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(bx, qx), _mm_mul_ps(by, qy)), _mm_mul_ps(bz, qz)), invDet);
+
+        __m128 mask = _mm_cmpneq_ps(det, zero);
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(triU, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(triV, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(triU, triV), one));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(distance, zero));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(distance, _mm_set1_ps(hitDistance)));
+        // the lanes past the range belong to other leaves or to the padding
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(lane, _mm_set1_ps((float)(first + count - i))));
+        int bits = _mm_movemask_ps(mask);
+        if (bits == 0) {
+            continue;
+        }
+        alignas(16) float distances[4], us[4], vs[4];
+        _mm_store_ps(distances, distance);
+        _mm_store_ps(us, triU);
+        _mm_store_ps(vs, triV);
+        for (int k = 0; k < 4; ++k) {
+            if ((bits >> k) & 1 && distances[k] < hitDistance) {
+                hitDistance = distances[k];
+                u = us[k];
+                v = vs[k];
+                hitIndex = (int)(i + k);
+            }
+        }
+        if (anyHit) {
+            break;
+        }
+    }
+    return hitIndex;
+#else
+    return intersectScalar(ray, first, count, hitDistance, u, v, anyHit);
+#endif
+}
+
+int TriangleStore::intersectAVX2(const Ray &ray, uint32_t first, uint32_t count, float &hitDistance, float &u, float &v, bool anyHit) const {
+#if SIMD_AVX2
+    const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    const __m256 lane = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+
+    int hitIndex = -1;
+    for (uint32_t i = first; i < first + count; i += 8) {
+        __m256 ax = _mm256_loadu_ps(&e1x[i]), ay = _mm256_loadu_ps(&e1y[i]), az = _mm256_loadu_ps(&e1z[i]);
+        __m256 bx = _mm256_loadu_ps(&e2x[i]), by = _mm256_loadu_ps(&e2y[i]), bz = _mm256_loadu_ps(&e2z[i]);
+        // p = d x e2
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, bz), _mm256_mul_ps(dz, by));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, bx), _mm256_mul_ps(dx, bz));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, by), _mm256_mul_ps(dy, bx));
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, px), _mm256_mul_ps(ay, py)), _mm256_mul_ps(az, pz));
+        __m256 invDet = _mm256_div_ps(one, det);
+        // t = o - v0
+        __m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(&v0x[i]));
+        __m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(&v0y[i]));
+        __m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(&v0z[i]));
+        __m256 triU = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+        // q = t x e1
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, az), _mm256_mul_ps(tz, ay));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, ax), _mm256_mul_ps(tx, az));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, ay), _mm256_mul_ps(ty, ax));
+        __m256 triV = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+        __m256 distance = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(bx, qx), _mm256_mul_ps(by, qy)), _mm256_mul_ps(bz, qz)), invDet);
+
+        __m256 mask = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(triU, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(triV, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(triU, triV), one, _CMP_LE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(distance, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(distance, _mm256_set1_ps(hitDistance), _CMP_LT_OQ));
+        // the lanes past the range belong to other leaves or to the padding
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(lane, _mm256_set1_ps((float)(first + count - i)), _CMP_LT_OQ));
+        int bits = _mm256_movemask_ps(mask);
+        if (bits == 0) {
+            continue;
+        }
+        alignas(32) float distances[8], us[8], vs[8];
+        _mm256_store_ps(distances, distance);
+        _mm256_store_ps(us, triU);
+        _mm256_store_ps(vs, triV);
+        for (int k = 0; k < 8; ++k) {
+            if ((bits >> k) & 1 && distances[k] < hitDistance) {
+                hitDistance = distances[k];
+                u = us[k];
+                v = vs[k];
+                hitIndex = (int)(i + k);
+            }
+        }
+        if (anyHit) {
+            break;
+        }
+    }
+    return hitIndex;
+#else
+    return intersectSSE(ray, first, count, hitDistance, u, v, anyHit);
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <vector>
+
+#include "geometry.h"
+#include "simd.h"
+
+enum class TriangleKernel { Scalar, SSE, AVX2 };
+
+// Triangles as the first vertex and two edges in structure of arrays layout, for Moller-Trumbore tests of one ray against several triangles at once.
+// The end is padded with degenerate triangles so that the wide kernels can always load full registers.
+class TriangleStore {
+public:
+    static constexpr uint32_t padding = 8;
+
+private:
+    uint32_t triangleCount = 0;
+
+    // anyHit returns the first hit found instead of the closest one
+    int intersectScalar(const Ray &ray, uint32_t first, uint32_t count, float &hitDistance, float &u, float &v, bool anyHit = false) const;
+    int intersectSSE(const Ray &ray, uint32_t first, uint32_t count, float &hitDistance, float &u, float &v, bool anyHit = false) const;
+    int intersectAVX2(const Ray &ray, uint32_t first, uint32_t count, float &hitDistance, float &u, float &v, bool anyHit = false) const;
+
+public:
+    std::vector<float> v0x, v0y, v0z;
+    std::vector<float> e1x, e1y, e1z;
+    std::vector<float> e2x, e2y, e2z;
+
+public:
+    void add(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2);
+    // call once after the last add
+    void pad();
+
+    uint32_t size() const { return triangleCount; }
+
+    // Test the triangles [first, first + count), return the index of the closest one nearer than hitDistance or -1.
+    // On a hit hitDistance is shrunk, u and v are the weights of the second and the third vertex.
+    int intersect(const Ray &ray, uint32_t first, uint32_t count, float &hitDistance, float &u, float &v, TriangleKernel kernel) const;
+    // whether any of the triangles [first, first + count) is hit before tMax, stops at the first hit
+    bool occluded(const Ray &ray, uint32_t first, uint32_t count, float tMax, TriangleKernel kernel) const;
+
+    static bool isKernelSupported(TriangleKernel kernel);
+    static const char *kernelName(TriangleKernel kernel);
+};
\ No newline at end of file
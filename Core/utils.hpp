@@ -13,6 +13,10 @@ namespace Utils {
         return result;
     }
 
+    inline float luminance(const glm::vec3 &color) {
+        return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    }
+
     template<typename T>
     inline T lerp(float alpha, float beta, T x, T y, T z) {
         return alpha * x + beta * y + (1 - alpha - beta) * z;
@@ -0,0 +1,76 @@
+#include "widebvh.h"
+#include "timer.h"
+
+template<uint32_t Width>
+void WideBVH<Width>::collapse(const BVH &bvh) {
+    Timer timer;
+    nodes.clear();
+    primIndices = bvh.primIndices;
+    if (!bvh.empty()) {
+        collapse(bvh, 0);
+    }
+    nodes.shrink_to_fit();
+    collapseTimeMs = timer.elapsedMs();
+}
+
+template<uint32_t Width>
+uint32_t WideBVH<Width>::collapse(const BVH &bvh, uint32_t binaryIndex) {
+    // open the inner child with the largest surface area until the node is full, a leaf root becomes the only child
+    uint32_t children[Width];
+    uint32_t childCount = 0;
+    const BVHNode &binaryNode = bvh.nodes[binaryIndex];
+    if (binaryNode.isLeaf()) {
+        children[childCount++] = binaryIndex;
+    }
+    else {
+        children[childCount++] = binaryNode.leftFirst;
+        children[childCount++] = binaryNode.leftFirst + 1;
+    }
+    while (childCount < Width) {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (uint32_t i = 0; i < childCount; ++i) {
+            const BVHNode &child = bvh.nodes[children[i]];
+            if (!child.isLeaf() && child.bounds.surfaceArea() > largestArea) {
+                largest = (int)i;
+                largestArea = child.bounds.surfaceArea();
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        uint32_t opened = children[largest];
+        children[largest] = bvh.nodes[opened].leftFirst;
+        children[childCount++] = bvh.nodes[opened].leftFirst + 1;
+    }
+
+    // children are allocated after their parent, like in the binary bvh
+    uint32_t nodeIndex = (uint32_t)nodes.size();
+    nodes.emplace_back();
+    WideBVHNode<Width> node;
+    node.childCount = childCount;
+    for (uint32_t i = 0; i < Width; ++i) {
+        if (i >= childCount) {
+            for (int a = 0; a < 3; ++a) {
+                node.bounds[a][i] = std::numeric_limits<float>::max();
+                node.bounds[a + 3][i] = -std::numeric_limits<float>::max();
+            }
+            node.child[i] = 0;
+            node.primCount[i] = 0;
+            continue;
+        }
+        const BVHNode &child = bvh.nodes[children[i]];
+        for (int a = 0; a < 3; ++a) {
+            node.bounds[a][i] = child.bounds.min[a];
+            node.bounds[a + 3][i] = child.bounds.max[a];
+        }
+        // the recursion grows nodes, so the node is only written back at the end
+        node.child[i] = child.isLeaf() ? child.leftFirst : collapse(bvh, children[i]);
+        node.primCount[i] = child.primCount;
+    }
+    nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
\ No newline at end of file
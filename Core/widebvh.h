@@ -0,0 +1,204 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "geometry.h"
+#include "bvh.h"
+#include "simd.h"
+
+// Children of a wide node in structure of arrays layout, so that one slab test covers all of them.
+template<uint32_t Width>
+struct alignas(Width * sizeof(float)) WideBVHNode {
+    // minX, minY, minZ, maxX, maxY, maxZ, unused slots are inverted boxes which the ordered slab test always misses
+    float bounds[6][Width];
+    // index of the wide node for inner children, index of the first primitive for leaves
+    uint32_t child[Width];
+    // 0 for inner children and unused slots
+    uint32_t primCount[Width];
+    uint32_t childCount;
+};
+
+// A binary BVH collapsed into Width-wide nodes. The leaves keep the primitive ranges of the binary one, so the primitives stay
+// in the same order.
+template<uint32_t Width>
+class WideBVH {
+    static_assert(Width == 4 || Width == 8, "wide bvh nodes are 4 or 8 wide");
+
+private:
+    uint32_t collapse(const BVH &bvh, uint32_t binaryIndex);
+
+    // set bit i and distances[i] for every child hit in front of hitDistance
+    int intersectChildren(const WideBVHNode<Width> &node, const Ray &ray, const glm::vec3 &invDir, const int near[3], const int far[3], float hitDistance, float *distances) const;
+
+public:
+    std::vector<WideBVHNode<Width>> nodes;
+    std::vector<uint32_t> primIndices;
+    float collapseTimeMs = 0.0f;
+
+public:
+    void collapse(const BVH &bvh);
+
+    bool empty() const { return nodes.empty(); }
+
+    // same as BVH::traverseLeaves, nodeVisits counts the visited wide nodes
+    template<typename LeafTest>
+    void traverseLeaves(const Ray &ray, float &hitDistance, LeafTest &&leafTest, uint32_t *nodeVisits = nullptr) const {
+        if (nodes.empty()) {
+            return;
+        }
+        const glm::vec3 invDir = 1.0f / ray.direction;
+        // take the near and the far plane of each axis by the sign of the direction, once for all nodes
+        int near[3], far[3];
+        for (int a = 0; a < 3; ++a) {
+            near[a] = invDir[a] < 0.0f ? a + 3 : a;
+            far[a] = invDir[a] < 0.0f ? a : a + 3;
+        }
+
+        struct StackEntry {
+            uint32_t child;
+            uint32_t primCount;
+            float distance;
+        };
+        StackEntry stack[BVH::maxDepth * (Width - 1)];
+        uint32_t stackSize = 0;
+        StackEntry entry{0, 0, 0.0f};
+        while (true) {
+            if (entry.primCount > 0) {
+                leafTest(entry.child, entry.primCount, hitDistance);
+            }
+            else {
+                const WideBVHNode<Width> &node = nodes[entry.child];
+                if (nodeVisits) {
+                    ++*nodeVisits;
+                }
+                alignas(Width * sizeof(float)) float distances[Width];
+                int hits = intersectChildren(node, ray, invDir, near, far, hitDistance, distances);
+                if (hits) {
+                    // sort the hit children far to near, push all of them but the nearest one
+                    StackEntry hitChildren[Width];
+                    uint32_t hitCount = 0;
+                    for (uint32_t i = 0; i < Width; ++i) {
+                        if (!((hits >> i) & 1)) {
+                            continue;
+                        }
+                        StackEntry e{node.child[i], node.primCount[i], distances[i]};
+                        uint32_t k = hitCount++;
+                        for (; k > 0 && hitChildren[k - 1].distance < e.distance; --k) {
+                            hitChildren[k] = hitChildren[k - 1];
+                        }
+                        hitChildren[k] = e;
+                    }
+                    for (uint32_t i = 0; i + 1 < hitCount; ++i) {
+                        stack[stackSize++] = hitChildren[i];
+                    }
+                    entry = hitChildren[hitCount - 1];
+                    continue;
+                }
+            }
+            // pop the next child which may still be in front of the closest hit
+            while (stackSize > 0 && stack[stackSize - 1].distance >= hitDistance) {
+                --stackSize;
+            }
+            if (stackSize == 0) {
+                break;
+            }
+            entry = stack[--stackSize];
+        }
+    }
+
+    // same as BVH::traverseAny
+    template<typename LeafTest>
+    bool traverseAny(const Ray &ray, float tMax, LeafTest &&leafTest, uint32_t *nodeVisits = nullptr) const {
+        if (nodes.empty()) {
+            return false;
+        }
+        const glm::vec3 invDir = 1.0f / ray.direction;
+        int near[3], far[3];
+        for (int a = 0; a < 3; ++a) {
+            near[a] = invDir[a] < 0.0f ? a + 3 : a;
+            far[a] = invDir[a] < 0.0f ? a : a + 3;
+        }
+
+        uint32_t stack[BVH::maxDepth * (Width - 1) + 1];
+        uint32_t stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0) {
+            const WideBVHNode<Width> &node = nodes[stack[--stackSize]];
+            if (nodeVisits) {
+                ++*nodeVisits;
+            }
+            alignas(Width * sizeof(float)) float distances[Width];
+            int hits = intersectChildren(node, ray, invDir, near, far, tMax, distances);
+            for (uint32_t i = 0; i < Width; ++i) {
+                if (!((hits >> i) & 1)) {
+                    continue;
+                }
+                if (node.primCount[i] == 0) {
+                    stack[stackSize++] = node.child[i];
+                }
+                else if (leafTest(node.child[i], node.primCount[i], tMax)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    template<typename PrimitiveTest>
+    void traverse(const Ray &ray, float &hitDistance, PrimitiveTest &&primitiveTest, uint32_t *nodeVisits = nullptr) const {
+        traverseLeaves(ray, hitDistance, [this, &primitiveTest](uint32_t first, uint32_t count, float &closest) {
+            for (uint32_t i = first; i < first + count; ++i) {
+                primitiveTest(primIndices[i], closest);
+            }
+        }, nodeVisits);
+    }
+};
+
+template<uint32_t Width>
+int WideBVH<Width>::intersectChildren(const WideBVHNode<Width> &node, const Ray &ray, const glm::vec3 &invDir, const int near[3], const int far[3], float hitDistance, float *distances) const {
+#if SIMD_AVX2
+    if constexpr (Width == 8) {
+        __m256 tNear = _mm256_setzero_ps(), tFar = _mm256_set1_ps(std::numeric_limits<float>::max());
+        for (int a = 0; a < 3; ++a) {
+            const __m256 o = _mm256_set1_ps(ray.origin[a]), inv = _mm256_set1_ps(invDir[a]);
+            tNear = _mm256_max_ps(tNear, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[near[a]]), o), inv));
+            tFar = _mm256_min_ps(tFar, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[far[a]]), o), inv));
+        }
+        __m256 mask = _mm256_and_ps(_mm256_cmp_ps(tFar, tNear, _CMP_GE_OQ), _mm256_cmp_ps(tNear, _mm256_set1_ps(hitDistance), _CMP_LT_OQ));
+        _mm256_store_ps(distances, tNear);
+        return _mm256_movemask_ps(mask);
+    }
+#endif
+#if SIMD_SSE
+    int hits = 0;
+    for (uint32_t i = 0; i < Width; i += 4) {
+        __m128 tNear = _mm_setzero_ps(), tFar = _mm_set1_ps(std::numeric_limits<float>::max());
+        for (int a = 0; a < 3; ++a) {
+            const __m128 o = _mm_set1_ps(ray.origin[a]), inv = _mm_set1_ps(invDir[a]);
+            tNear = _mm_max_ps(tNear, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[near[a]][i]), o), inv));
+            tFar = _mm_min_ps(tFar, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[far[a]][i]), o), inv));
+        }
+        __m128 mask = _mm_and_ps(_mm_cmpge_ps(tFar, tNear), _mm_cmplt_ps(tNear, _mm_set1_ps(hitDistance)));
+        _mm_store_ps(&distances[i], tNear);
+        hits |= _mm_movemask_ps(mask) << i;
+    }
+    return hits;
+#else
+    int hits = 0;
+    for (uint32_t i = 0; i < Width; ++i) {
+        float tNear = 0.0f, tFar = std::numeric_limits<float>::max();
+        for (int a = 0; a < 3; ++a) {
+            tNear = std::max(tNear, (node.bounds[near[a]][i] - ray.origin[a]) * invDir[a]);
+            tFar = std::min(tFar, (node.bounds[far[a]][i] - ray.origin[a]) * invDir[a]);
+        }
+        distances[i] = tNear;
+        if (tFar >= tNear && tNear < hitDistance) {
+            hits |= 1 << i;
+        }
+    }
+    return hits;
+#endif
+}
\ No newline at end of file
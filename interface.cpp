@@ -12,6 +12,9 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <memory>
+#include <future>
+#include <deque>
+#include <algorithm>
 
 class RendererLayer : public Layer {
     uint32_t imageWidth = 0, imageHeight = 0;
@@ -21,6 +24,18 @@ class RendererLayer : public Layer {
     bool autoRender = false;
 
     float lastRenderTimeCost = 0;
+    // the model being loaded, with its bvh, off the ui thread
+    std::future<Model> pendingModel;
+    // models picked while another one was loading
+    std::deque<std::string> queuedModelPaths;
+    // bvhs rebuilt off the ui thread after the build quality changed, the tasks read the models in place, so no model is added
+    // or deleted until all of them are swapped in
+    struct PendingBVH {
+        uint64_t modelId;
+        BVH::BuildQuality quality;
+        std::future<ModelBVH> bvh;
+    };
+    std::vector<PendingBVH> pendingBVHs;
 
 private:
     void render() {
@@ -45,7 +60,7 @@ public:
     virtual void onUpdate(float timestep) override {
         if (camera.onUpdate(timestep)) {
             // camera moved
-            renderer.resetTracerFrame();
+            renderer.moveTracerCamera();
         }
     }
 
@@ -81,11 +96,241 @@ public:
             }
         }
         if (ImGui::CollapsingHeader("Rasterizer Settings")) {
-            
+            {
+                int threadCount = (int)renderer.rasterizerSettings->threadCount;
+                ImGui::DragInt("rasterizer threads (0 = all)", &threadCount, 1, 0, (int)ThreadPool::hardwareThreads());
+                renderer.rasterizerSettings->threadCount = (uint32_t)std::max(threadCount, 0);
+                int tileSize = (int)renderer.rasterizerSettings->tileSize;
+                ImGui::Text("bin size"); ImGui::SameLine();
+                ImGui::RadioButton("32##bin", &tileSize, 32); ImGui::SameLine();
+                ImGui::RadioButton("64##bin", &tileSize, 64); ImGui::SameLine();
+                ImGui::RadioButton("128##bin", &tileSize, 128);
+                renderer.rasterizerSettings->tileSize = (uint32_t)tileSize;
+            }
+            {
+                int kernelIndex = (int)renderer.rasterizerSettings->coverageKernel;
+                ImGui::Text("coverage test");
+                for (auto kernel : {CoverageKernel::Scalar, CoverageKernel::SSE, CoverageKernel::AVX2}) {
+                    if (Rasterizer::isKernelSupported(kernel)) {
+                        ImGui::SameLine();
+                        // the tracer settings have buttons with the same names
+                        ImGui::PushID("coverage");
+                        ImGui::RadioButton(Rasterizer::kernelName(kernel), &kernelIndex, (int)kernel);
+                        ImGui::PopID();
+                    }
+                }
+                renderer.rasterizerSettings->coverageKernel = (CoverageKernel)kernelIndex;
+                ImGui::Checkbox("fixed point sub-pixels", &renderer.rasterizerSettings->fixedPoint);
+            }
+            const auto &stats = *renderer.rasterizerStats;
+            ImGui::Text("%u vertices, %u triangles in %u bins (%.2f per triangle) on %u threads", stats.vertexCount, stats.triangleCount, stats.binnedCount,
+                stats.triangleCount > 0 ? (float)stats.binnedCount / stats.triangleCount : 0.0f, stats.threadCount);
+            ImGui::Text("%u triangles rejected, %u clipped", stats.rejectedCount, stats.clippedCount);
+            ImGui::Text("geometry %.2fms, binning %.2fms, raster %.2fms", stats.geometryTimeMs, stats.binTimeMs, stats.rasterTimeMs);
+            if (ImGui::Button("thread scaling benchmark")) {
+                renderer.benchmarkRasterizerScaling(scene, camera);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("triangle size benchmark")) {
+                renderer.benchmarkRasterizerTriangleSizes(camera);
+            }
+            for (const auto &result : stats.scalingBenchmark) {
+                ImGui::Text("%u threads: %.2fms, %.2fx", result.threadCount, result.timeMs, result.speedup);
+            }
+            for (const auto &result : stats.triangleSizeBenchmark) {
+                ImGui::Text("%s%s, %upx: %u triangles in %.1fms, %.2fM triangles/s, %.1fM pixels/s", result.name, result.fixedPoint ? " fixed point" : "", result.size,
+                    result.triangles, result.timeMs, result.timeMs > 0.0f ? result.triangles / result.timeMs * 0.001f : 0.0f,
+                    result.timeMs > 0.0f ? result.pixels / result.timeMs * 0.001f : 0.0f);
+            }
         }
         if (ImGui::CollapsingHeader("RayTracer Settings")) {
             ImGui::Checkbox("accumulate", &renderer.tracerSettings->accumulate);
-            ImGui::DragInt("bounce times", &renderer.tracerSettings->bounceTimes, 1, 2, 10);
+            {
+                ImGui::Checkbox("adaptive sampling", &renderer.tracerSettings->adaptiveSampling); ImGui::SameLine();
+                ImGui::Checkbox("stop when converged", &renderer.tracerSettings->stopWhenConverged);
+                ImGui::DragFloat("error threshold", &renderer.tracerSettings->errorThreshold, 0.001f, 0.001f, 0.5f);
+                int minSamples = (int)renderer.tracerSettings->minSamples;
+                ImGui::DragInt("min samples", &minSamples, 1, 2, 1024);
+                renderer.tracerSettings->minSamples = (uint32_t)std::max(minSamples, 2);
+                if (renderer.tracerSettings->adaptiveSampling && renderer.tracerSettings->accumulate) {
+                    ImGui::Text("converged tiles: %u/%u%s", renderer.tracerStats->convergedTiles, (uint32_t)renderer.tracerStats->tileTimings.size(),
+                        renderer.tracerStats->converged ? ", converged" : "");
+                }
+            }
+            ImGui::DragInt("bounce times", &renderer.tracerSettings->bounceTimes, 1, 2, 32);
+            {
+                int integrator = (int)renderer.tracerSettings->integrator;
+                ImGui::Text("integrator"); ImGui::SameLine();
+                ImGui::RadioButton("megakernel", &integrator, (int)Tracer::Integrator::Megakernel); ImGui::SameLine();
+                ImGui::RadioButton("wavefront", &integrator, (int)Tracer::Integrator::Wavefront);
+                renderer.tracerSettings->integrator = (Tracer::Integrator)integrator;
+                int sampler = (int)renderer.tracerSettings->sampler;
+                ImGui::Text("sampler"); ImGui::SameLine();
+                for (auto type : {SamplerType::Random, SamplerType::Sobol, SamplerType::BlueNoise}) {
+                    ImGui::RadioButton(Sampler::name(type), &sampler, (int)type);
+                    ImGui::SameLine();
+                }
+                ImGui::NewLine();
+                renderer.tracerSettings->sampler = (SamplerType)sampler;
+                if (renderer.tracerSettings->integrator == Tracer::Integrator::Wavefront) {
+                    ImGui::SameLine();
+                    ImGui::Checkbox("sort by material", &renderer.tracerSettings->sortByMaterial);
+                }
+                ImGui::Checkbox("russian roulette", &renderer.tracerSettings->russianRoulette); ImGui::SameLine();
+                ImGui::DragInt("after bounce", &renderer.tracerSettings->rouletteDepth, 1, 1, 10);
+                ImGui::Checkbox("light sampling", &renderer.tracerSettings->lightSampling); ImGui::SameLine();
+                ImGui::Text("%u direction lights, %u emissive triangles, light list made %u times, last in %.2fms", (uint32_t)scene.lights.size(),
+                    renderer.tracerStats->emissiveTriangleCount, renderer.tracerStats->lightBuildCount, renderer.tracerStats->lightBuildTimeMs);
+                float traceTimeMs = renderer.tracerStats->traceTimeMs;
+                uint64_t pathCount = renderer.tracerStats->pathCount;
+                ImGui::Text("%llu rays in %.1fms, %.2f Mrays/s, %.2f rays/path, %.2f Mpaths/s", (unsigned long long)renderer.tracerStats->rayCount, traceTimeMs,
+                    traceTimeMs > 0.0f ? renderer.tracerStats->rayCount / (traceTimeMs * 1000.0f) : 0.0f,
+                    pathCount > 0 ? (float)renderer.tracerStats->rayCount / pathCount : 0.0f, traceTimeMs > 0.0f ? pathCount / (traceTimeMs * 1000.0f) : 0.0f);
+                for (size_t i = 0; i < renderer.tracerStats->wavefrontBounces.size(); ++i) {
+                    const auto &bounce = renderer.tracerStats->wavefrontBounces[i];
+                    ImGui::Text("bounce %u: %u rays, %u shadow rays, trace %.2fms, sort %.2fms, shade %.2fms, compact %.2fms", (uint32_t)i, bounce.rayCount,
+                        bounce.shadowRayCount, bounce.traceTimeMs, bounce.sortTimeMs, bounce.shadeTimeMs, bounce.compactTimeMs);
+                }
+            }
+            {
+                ImGui::Checkbox("denoise", &renderer.tracerSettings->denoise);
+                if (renderer.tracerSettings->denoise) {
+                    ImGui::SameLine();
+                    ImGui::Text("in %.2fms", renderer.tracerStats->denoiseTimeMs);
+                    auto &denoiser = renderer.tracerSettings->denoiser;
+                    ImGui::DragInt("filter iterations", &denoiser.iterations, 1, 1, 8);
+                    ImGui::DragFloat("color phi", &denoiser.colorPhi, 0.1f, 0.1f, 64.0f);
+                    ImGui::DragFloat("depth phi", &denoiser.depthPhi, 0.001f, 0.001f, 1.0f);
+                    ImGui::DragInt("normal power", &denoiser.normalPower, 1, 1, 256);
+                }
+                ImGui::Checkbox("progressive preview", &renderer.tracerSettings->progressive);
+                if (renderer.tracerSettings->progressive && renderer.tracerStats->previewScale > 1) {
+                    ImGui::SameLine();
+                    ImGui::Text("showing 1/%u of the pixels", renderer.tracerStats->previewScale);
+                }
+                ImGui::Checkbox("cache primary hits", &renderer.tracerSettings->cachePrimaryHits);
+                if (renderer.tracerSettings->cachePrimaryHits) {
+                    ImGui::SameLine();
+                    ImGui::Text(renderer.tracerStats->primaryHitsCached ? "last frame started from the cache" : "last frame traced them");
+                }
+                ImGui::Checkbox("reproject on camera motion", &renderer.tracerSettings->reprojection);
+                if (renderer.tracerSettings->reprojection) {
+                    ImGui::SameLine();
+                    ImGui::Text("kept %u pixels in %.2fms", renderer.tracerStats->reprojectedPixels, renderer.tracerStats->reprojectionTimeMs);
+                    ImGui::DragFloat("reprojection tolerance", &renderer.tracerSettings->reprojectionTolerance, 0.001f, 0.001f, 0.2f);
+                    int maxReprojectedSamples = (int)renderer.tracerSettings->maxReprojectedSamples;
+                    ImGui::DragInt("max reprojected samples", &maxReprojectedSamples, 1, 1, 4096);
+                    renderer.tracerSettings->maxReprojectedSamples = (uint32_t)std::max(maxReprojectedSamples, 1);
+                }
+            }
+            {
+                int qualityIndex = (int)renderer.tracerSettings->bvhQuality;
+                ImGui::Text("bvh build"); ImGui::SameLine();
+                ImGui::RadioButton("fast (lbvh)", &qualityIndex, (int)BVH::BuildQuality::Fast); ImGui::SameLine();
+                ImGui::RadioButton("sah", &qualityIndex, (int)BVH::BuildQuality::SAH);
+                // the models are rebuilt by updateModels()
+                renderer.tracerSettings->bvhQuality = (BVH::BuildQuality)qualityIndex;
+                if (!pendingBVHs.empty()) {
+                    ImGui::SameLine();
+                    ImGui::Text("rebuilding %u bvhs...", (uint32_t)pendingBVHs.size());
+                }
+            }
+            {
+                int kernelIndex = (int)renderer.tracerSettings->triangleKernel;
+                ImGui::Text("triangle test");
+                for (auto kernel : {TriangleKernel::Scalar, TriangleKernel::SSE, TriangleKernel::AVX2}) {
+                    if (TriangleStore::isKernelSupported(kernel)) {
+                        ImGui::SameLine();
+                        ImGui::RadioButton(TriangleStore::kernelName(kernel), &kernelIndex, (int)kernel);
+                    }
+                }
+                renderer.tracerSettings->triangleKernel = (TriangleKernel)kernelIndex;
+            }
+            {
+                int width = (int)renderer.tracerSettings->bvhWidth;
+                ImGui::Text("bvh width"); ImGui::SameLine();
+                ImGui::RadioButton("2", &width, 2); ImGui::SameLine();
+                ImGui::RadioButton("4", &width, 4); ImGui::SameLine();
+                ImGui::RadioButton("8", &width, 8);
+                renderer.tracerSettings->bvhWidth = (uint32_t)width;
+            }
+            ImGui::Checkbox("packet primary rays", &renderer.tracerSettings->packetTracing);
+            {
+                int threadCount = (int)renderer.tracerSettings->threadCount;
+                ImGui::DragInt("threads (0 = all)", &threadCount, 1, 0, (int)ThreadPool::hardwareThreads());
+                renderer.tracerSettings->threadCount = (uint32_t)std::max(threadCount, 0);
+                int tileSize = (int)renderer.tracerSettings->tileSize;
+                ImGui::Text("tile size"); ImGui::SameLine();
+                ImGui::RadioButton("16", &tileSize, 16); ImGui::SameLine();
+                ImGui::RadioButton("32", &tileSize, 32); ImGui::SameLine();
+                ImGui::RadioButton("64", &tileSize, 64);
+                renderer.tracerSettings->tileSize = (uint32_t)tileSize;
+
+                // the wavefront integrator does not trace per tile
+                const auto &tileTimings = renderer.tracerStats->tileTimings;
+                if (!tileTimings.empty() && renderer.tracerSettings->integrator == Tracer::Integrator::Megakernel) {
+                    float minMs = tileTimings[0].timeMs, maxMs = 0.0f, sumMs = 0.0f;
+                    std::vector<float> threadMs(renderer.tracerStats->threadCount, 0.0f);
+                    for (const auto &tile : tileTimings) {
+                        minMs = std::min(minMs, tile.timeMs);
+                        maxMs = std::max(maxMs, tile.timeMs);
+                        sumMs += tile.timeMs;
+                        if (tile.threadIndex < threadMs.size()) {
+                            threadMs[tile.threadIndex] += tile.timeMs;
+                        }
+                    }
+                    float busiestMs = threadMs.empty() ? 0.0f : *std::max_element(threadMs.begin(), threadMs.end());
+                    ImGui::Text("%u tiles on %u threads: %.2f/%.2f/%.2fms min/avg/max per tile, busiest thread %.1fms of %.1fms average",
+                        (uint32_t)tileTimings.size(), renderer.tracerStats->threadCount, minMs, sumMs / tileTimings.size(), maxMs,
+                        busiestMs, threadMs.empty() ? 0.0f : sumMs / threadMs.size());
+                }
+            }
+            ImGui::DragFloat("tlas rebuild threshold", &renderer.tracerSettings->tlasRebuildThreshold, 0.05f, 1.0f, 10.0f);
+            ImGui::Text("tlas: %u instances, %u nodes, rebuilt %u times, last build %.3fms", renderer.tracerStats->tlas.primCount, renderer.tracerStats->tlas.nodeCount, renderer.tracerStats->tlasBuildCount, renderer.tracerStats->tlas.buildTimeMs);
+            ImGui::Text("tlas: refitted %u times, sah cost %.2f (%.2f when built)%s", renderer.tracerStats->tlasRefitCount, renderer.tracerStats->tlasSahCost, renderer.tracerStats->tlas.sahCost,
+                renderer.tracerStats->tlasRebuildPending ? ", rebuilding" : "");
+            if (ImGui::Button("bvh benchmark")) {
+                renderer.benchmarkTracerBVH(scene, camera);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("triangle test benchmark")) {
+                renderer.benchmarkTracerTriangleKernels(scene, camera);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("primary ray benchmark")) {
+                renderer.benchmarkTracerPrimaryRays(scene, camera);
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("sampler benchmark")) {
+                renderer.benchmarkTracerSamplers(scene, camera);
+            }
+            for (const auto &result : renderer.tracerStats->samplerBenchmark) {
+                if (result.targetSamples > 0) {
+                    ImGui::Text("%s: error %.2f%% after %u samples in %.0fms, %.0f%% reached after %u samples in %.0fms", result.name, result.error * 100.0f,
+                        result.samples, result.timeMs, Tracer::samplerTargetError * 100.0f, result.targetSamples, result.targetTimeMs);
+                }
+                else {
+                    ImGui::Text("%s: error %.2f%% after %u samples in %.0fms, %.0f%% not reached", result.name, result.error * 100.0f,
+                        result.samples, result.timeMs, Tracer::samplerTargetError * 100.0f);
+                }
+            }
+            for (const auto &result : renderer.tracerStats->primaryRayBenchmark) {
+                ImGui::Text("%s (1 thread): %u rays in %.1fms, %.2fM rays/s, %u hits, %u incoherent packets", result.name, result.rays, result.timeMs,
+                    result.timeMs > 0.0f ? result.rays / result.timeMs * 0.001f : 0.0f, result.hits, result.incoherentPackets);
+            }
+            for (const auto &result : renderer.tracerStats->triangleKernelBenchmark) {
+                ImGui::Text("%s: %llu tests in %.1fms, %.1fM tests/s, %u hits", result.name, (unsigned long long)result.tests, result.timeMs,
+                    result.timeMs > 0.0f ? result.tests / result.timeMs * 0.001f : 0.0f, result.hits);
+            }
+            for (const auto &result : renderer.tracerStats->bvhBenchmark) {
+                if (result.width == 2) {
+                    ImGui::Text("model %d %s: build %.1fms (%u threads), %u nodes, depth %u, sah cost %.2f",
+                        result.modelIndex, result.quality == BVH::BuildQuality::Fast ? "lbvh" : "sah", result.bvh.buildTimeMs, result.bvh.threadCount,
+                        result.bvh.nodeCount, result.bvh.maxDepth, result.bvh.sahCost);
+                }
+                ImGui::Text("    width %u: %u nodes (collapsed in %.1fms), %u primary rays in %.1fms, %.1f nodes/ray, %.1f triangles/ray",
+                    result.width, result.nodeCount, result.collapseTimeMs, result.rayCount, result.traceTimeMs, result.nodeVisitsPerRay, result.triangleTestsPerRay);
+            }
         }
         if (ImGui::Button("Render")) {
             render();
@@ -94,16 +339,25 @@ public:
 
         ImGui::Begin("Scene");
         if (ImGui::CollapsingHeader("Objects")) {
+            if (pendingModel.valid()) {
+                ImGui::Text("loading model..., %u more queued", (uint32_t)queuedModelPaths.size());
+            }
             {
                 int deleteIndex = -1;
                 for (size_t i = 0; i < scene.models.size(); ++i) {
                     ImGui::PushID((int)i);
                     ImGui::Text("Model %u", i); ImGui::SameLine();
-                    if (ImGui::Button("delete")) {
+                    if (!pendingBVHs.empty()) {
+                        ImGui::Text("rebuilding bvh");
+                    }
+                    else if (ImGui::Button("delete")) {
                         deleteIndex = (int)i;
                     }
                     ImGui::DragFloat3("scale", glm::value_ptr(scene.models[i].scale), 0.1f, 0.1f, 100.0f);
                     ImGui::DragFloat3("translate", glm::value_ptr(scene.models[i].translate), 0.1f);
+                    const BVHStats &bvhStats = scene.models[i].bvh.stats;
+                    ImGui::Text("bvh: %u triangles, %u nodes, %u leaves, depth %u", bvhStats.primCount, bvhStats.nodeCount, bvhStats.leafCount, bvhStats.maxDepth);
+                    ImGui::Text("bvh: sah cost %.2f, build %.1fms", bvhStats.sahCost, bvhStats.buildTimeMs);
                     ImGui::PopID();
                 }
                 if (deleteIndex != -1) {
@@ -140,10 +394,13 @@ public:
         ImGui::PopStyleVar();
 
         openModel();
+        updateModels();
 
         // When executing here for the first time, the width and height have not been set, so render() cannot be called at first.
         // if (autoRender && renderer.rendererSettings.renderingMode == Renderer::RenderingMode::Rasterization) {
-        if (autoRender) {
+        // a preview pass of the tracer is followed by the next one until the frame is complete, also without auto render
+        bool previewing = renderer.rendererSettings.renderingMode == Renderer::RenderingMode::RayTracing && renderer.tracerStats->previewScale > 1;
+        if (autoRender || previewing) {
             render();
         }
     }
@@ -156,11 +413,65 @@ public:
 
                 // std::cout << "filePathName = " << filePathName << std::endl;
                 // std::cout << "filePath = " << filePath << std::endl;
-                scene.models.emplace_back(Model(filePathName));
+                // loaded one at a time by updateModels()
+                queuedModelPaths.push_back(filePathName);
             }
             ImGuiFileDialog::Instance()->Close();
         }
     }
+
+    // swaps in the models and bvhs built off the ui thread and starts the next builds
+    void updateModels() {
+        const BVH::BuildQuality quality = renderer.tracerSettings->bvhQuality;
+        bool swapped = false;
+        for (auto it = pendingBVHs.begin(); it != pendingBVHs.end();) {
+            if (it->bvh.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++it;
+                continue;
+            }
+            ModelBVH built = it->bvh.get();
+            // the quality may have changed again while it was built
+            if (it->quality == quality) {
+                for (auto &model : scene.models) {
+                    if (model.id == it->modelId) {
+                        model.setBVH(std::move(built));
+                        swapped = true;
+                    }
+                }
+            }
+            it = pendingBVHs.erase(it);
+        }
+        if (swapped) {
+            renderer.resetTracerFrame();
+        }
+
+        if (pendingBVHs.empty() && pendingModel.valid() && pendingModel.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            scene.models.emplace_back(pendingModel.get());
+        }
+        if (!pendingModel.valid() && !queuedModelPaths.empty()) {
+            std::string filePathName = queuedModelPaths.front();
+            queuedModelPaths.pop_front();
+            pendingModel = std::async(std::launch::async, [filePathName, quality]() {
+                return Model(filePathName, quality);
+            });
+        }
+
+        // also catches the models which were loaded with the previous quality
+        for (const auto &model : scene.models) {
+            if (model.bvhQuality == quality) {
+                continue;
+            }
+            bool building = std::any_of(pendingBVHs.begin(), pendingBVHs.end(), [&model, quality](const PendingBVH &pending) {
+                return pending.modelId == model.id && pending.quality == quality;
+            });
+            if (!building) {
+                const Model *source = &model;
+                pendingBVHs.push_back({model.id, quality, std::async(std::launch::async, [source, quality]() {
+                    return source->buildBVH(quality);
+                })});
+            }
+        }
+    }
 };
 
 Application* createApplication() {